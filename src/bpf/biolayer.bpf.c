@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: MIT
+/*
+ * biolayer: bio latency per block device layer, with split, merge and
+ * remap accounting for dm/md stacks.
+ *
+ * submit_bio_noacct() traces block_bio_queue once per bio and flags it so
+ * that bio_endio() traces block_bio_complete, which gives every bio a
+ * start and an end.  A bio is accounted to the device it completes on:
+ *
+ *	block_bio_queue		start, device and size
+ *	block_bio_remap		dm clones appear here before they are queued;
+ *				in-place remaps (md raid0) move the bio to
+ *				the member device.  Both count an edge
+ *				old_dev -> dev in `edges`.  Partition remaps
+ *				only shift the sector and keep bi_bdev, so
+ *				old_dev == dev; they are not a layer and
+ *				are ignored
+ *	block_split		the split-off front bio, counted on its device
+ *	block_bio_*merge	bio merged into an existing request
+ *	block_bio_complete	latency into `layers` per (dev, op)
+ *
+ * An upper layer's latency includes the bios it sent down, so the time a
+ * layer adds is its latency minus that of the layer below, following
+ * `edges`.  Bios slower than slow_ns are also sent one by one on
+ * `slow_bios` with their flags and where they came from.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "blk.h"
+
+#define MAX_BIOS	65536
+#define MAX_DEVS	1024
+#define MAX_EDGES	1024
+
+#define BIO_F_SPLIT	(1U << 0)
+#define BIO_F_MERGED	(1U << 1)
+#define BIO_F_REMAPPED	(1U << 2)
+
+const volatile __u64 slow_ns = 100 * NSEC_PER_MSEC;
+
+struct bio_start {
+	__u64 ts;
+	__u64 sector;
+	__u32 dev;
+	__u32 from_dev;
+	__u32 sectors;
+	__u32 flags;
+};
+
+struct layer_key {
+	__u32 dev;
+	__u32 op;
+};
+
+struct layer_stat {
+	__u64 count;
+	__u64 sectors;
+	__u64 total_ns;
+	__u64 max_ns;
+	__u64 errors;
+	__u64 splits;
+	__u64 merges;
+	__u64 remapped;
+	/* Completion latency, in microseconds. */
+	struct hist hist;
+};
+
+struct edge_key {
+	__u32 from_dev;
+	__u32 to_dev;
+};
+
+struct edge_stat {
+	__u64 count;
+	__u64 sectors;
+};
+
+struct slow_bio {
+	__u64 sector;
+	__u64 lat_ns;
+	__u32 dev;
+	__u32 from_dev;
+	__u32 sectors;
+	__u32 op;
+	__u32 flags;
+	__s32 error;
+};
+
+/* Bios lost from this table only lose their latency sample. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_BIOS);
+	__type(key, __u64);
+	__type(value, struct bio_start);
+} bios SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_DEVS);
+	__type(key, struct layer_key);
+	__type(value, struct layer_stat);
+} layers SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_EDGES);
+	__type(key, struct edge_key);
+	__type(value, struct edge_stat);
+} edges SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} slow_bios SEC(".maps");
+
+static struct layer_stat zero_layer;
+static struct edge_stat zero_edge;
+
+static __always_inline struct layer_stat *layer_get(struct bio *bio)
+{
+	struct layer_key key = {
+		.dev = bio_dev(bio),
+		.op = bio_op(bio),
+	};
+
+	return map_lookup_or_try_init(&layers, &key, &zero_layer);
+}
+
+static __always_inline struct bio_start *bio_track(struct bio *bio)
+{
+	__u64 key = (__u64)bio;
+	struct bio_start s = {}, *sp;
+
+	sp = bpf_map_lookup_elem(&bios, &key);
+	if (sp)
+		return sp;
+
+	s.ts = bpf_ktime_get_ns();
+	s.dev = bio_dev(bio);
+	s.sector = BPF_CORE_READ(bio, bi_iter.bi_sector);
+	s.sectors = bio_sectors(bio);
+	bpf_map_update_elem(&bios, &key, &s, BPF_NOEXIST);
+	return bpf_map_lookup_elem(&bios, &key);
+}
+
+SEC("tp_btf/block_bio_queue")
+int BPF_PROG(block_bio_queue, struct bio *bio)
+{
+	bio_track(bio);
+	return 0;
+}
+
+SEC("tp_btf/block_bio_remap")
+int BPF_PROG(block_bio_remap, struct bio *bio, dev_t old_dev, sector_t from)
+{
+	struct edge_key ekey = { .from_dev = old_dev };
+	struct layer_stat *ls;
+	struct edge_stat *es;
+	struct bio_start *s;
+	__u32 dev = bio_dev(bio);
+
+	if (dev == old_dev)
+		return 0;
+
+	s = bio_track(bio);
+	if (!s)
+		return 0;
+
+	s->from_dev = old_dev;
+	s->dev = dev;
+	s->flags |= BIO_F_REMAPPED;
+
+	ekey.to_dev = dev;
+	es = map_lookup_or_try_init(&edges, &ekey, &zero_edge);
+	if (es) {
+		__sync_fetch_and_add(&es->count, 1);
+		__sync_fetch_and_add(&es->sectors, s->sectors);
+	}
+
+	ls = layer_get(bio);
+	if (ls)
+		__sync_fetch_and_add(&ls->remapped, 1);
+	return 0;
+}
+
+SEC("tp_btf/block_split")
+int BPF_PROG(block_split, struct bio *bio, unsigned int new_sector)
+{
+	struct layer_stat *ls;
+	struct bio_start *s;
+
+	s = bio_track(bio);
+	if (s)
+		s->flags |= BIO_F_SPLIT;
+
+	ls = layer_get(bio);
+	if (ls)
+		__sync_fetch_and_add(&ls->splits, 1);
+	return 0;
+}
+
+static __always_inline void bio_merged(struct bio *bio)
+{
+	__u64 key = (__u64)bio;
+	struct layer_stat *ls;
+	struct bio_start *s;
+
+	s = bpf_map_lookup_elem(&bios, &key);
+	if (s)
+		s->flags |= BIO_F_MERGED;
+
+	ls = layer_get(bio);
+	if (ls)
+		__sync_fetch_and_add(&ls->merges, 1);
+}
+
+SEC("tp_btf/block_bio_backmerge")
+int BPF_PROG(block_bio_backmerge, struct bio *bio)
+{
+	bio_merged(bio);
+	return 0;
+}
+
+SEC("tp_btf/block_bio_frontmerge")
+int BPF_PROG(block_bio_frontmerge, struct bio *bio)
+{
+	bio_merged(bio);
+	return 0;
+}
+
+SEC("tp_btf/block_bio_complete")
+int BPF_PROG(block_bio_complete, struct request_queue *q, struct bio *bio)
+{
+	struct layer_key key = {};
+	struct layer_stat *ls;
+	struct slow_bio *e;
+	struct bio_start *s;
+	__u64 bkey = (__u64)bio;
+	__u64 delta;
+	__s32 error;
+
+	s = bpf_map_lookup_elem(&bios, &bkey);
+	if (!s)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - s->ts;
+	error = BPF_CORE_READ(bio, bi_status);
+	key.dev = s->dev;
+	key.op = bio_op(bio);
+
+	ls = map_lookup_or_try_init(&layers, &key, &zero_layer);
+	if (ls) {
+		__sync_fetch_and_add(&ls->count, 1);
+		__sync_fetch_and_add(&ls->sectors, s->sectors);
+		__sync_fetch_and_add(&ls->total_ns, delta);
+		max_store(&ls->max_ns, delta);
+		if (error)
+			__sync_fetch_and_add(&ls->errors, 1);
+		hist_add(&ls->hist, delta / NSEC_PER_USEC);
+	}
+
+	if (delta >= slow_ns) {
+		e = bpf_ringbuf_reserve(&slow_bios, sizeof(*e), 0);
+		if (e) {
+			e->sector = s->sector;
+			e->lat_ns = delta;
+			e->dev = s->dev;
+			e->from_dev = s->from_dev;
+			e->sectors = s->sectors;
+			e->op = key.op;
+			e->flags = s->flags;
+			e->error = error;
+			bpf_ringbuf_submit(e, 0);
+		}
+	}
+
+	bpf_map_delete_elem(&bios, &bkey);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Block layer accessors shared by the bio and request tools.
+ */
+#ifndef __CX_BLK_H
+#define __CX_BLK_H
+
+#define REQ_OP_BITS	8
+#define REQ_OP_MASK	((1U << REQ_OP_BITS) - 1)
+
+/* REQ_OP_READ, REQ_OP_WRITE, REQ_OP_FLUSH, REQ_OP_DISCARD, ... */
+#define MAX_REQ_OP	16
+
+static __always_inline __u32 bio_dev(struct bio *bio)
+{
+	return BPF_CORE_READ(bio, bi_bdev, bd_dev);
+}
+
+static __always_inline __u32 bio_op(struct bio *bio)
+{
+	__u32 op = BPF_CORE_READ(bio, bi_opf) & REQ_OP_MASK;
+
+	return op < MAX_REQ_OP ? op : MAX_REQ_OP - 1;
+}
+
+static __always_inline __u32 bio_sectors(struct bio *bio)
+{
+	return BPF_CORE_READ(bio, bi_iter.bi_size) >> 9;
+}
+
+/* dev_t of the whole disk behind a queue, in the kernel's MKDEV layout. */
+static __always_inline __u32 queue_dev(struct request_queue *q)
+{
+	struct gendisk *disk = BPF_CORE_READ(q, disk);
+
+	if (!disk)
+		return 0;
+	return (BPF_CORE_READ(disk, major) << 20) |
+	       BPF_CORE_READ(disk, first_minor);
+}
+
+static __always_inline __u32 rq_op(struct request *rq)
+{
+	__u32 op = BPF_CORE_READ(rq, cmd_flags) & REQ_OP_MASK;
+
+	return op < MAX_REQ_OP ? op : MAX_REQ_OP - 1;
+}
+
+#endif /* __CX_BLK_H */
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: MIT
+/*
+ * cachestat: page cache hit ratio per (cgroup, inode).
+ *
+ * Four cheap events are counted, the same inputs the classic cachestat
+ * uses:
+ *
+ *	accesses	folio_mark_accessed()
+ *	adds		mm_filemap_add_to_page_cache
+ *	dirtied		writeback_dirty_folio
+ *	evictions	mm_filemap_delete_from_page_cache
+ *
+ * Writes add folios without a read miss, so user space derives
+ *
+ *	misses = adds - dirtied
+ *	hits   = accesses - misses
+ *
+ * clamping both at zero.  Every event is charged to the cgroup of the
+ * memcg the folio is charged to, not to the current task: evictions run
+ * from reclaim with no useful task, and a page cache hit on a folio some
+ * other cgroup brought in is that cgroup's page being reused, so one
+ * scheme keeps the per-cgroup ratios consistent.  Uncharged folios (or no
+ * memcg) count under cgroup 0.  Paths are captured from the struct file
+ * on the read path (filemap_read) the first time an inode shows up.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "mm.h"
+#include "path.h"
+
+#define MAX_STATS	65536
+#define MAX_PATHS	16384
+#define MAX_CGROUPS	8192
+
+enum cache_event {
+	CACHE_ACCESS,
+	CACHE_ADD,
+	CACHE_DIRTY,
+	CACHE_EVICT,
+	CACHE_MAX,
+};
+
+/* Set to restrict per-inode stats to one cgroup; totals are always kept. */
+const volatile __u64 targ_cgid = 0;
+
+struct cache_key {
+	__u64 cgid;
+	struct inode_key inode;
+};
+
+struct cache_stat {
+	__u64 count[CACHE_MAX];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_STATS);
+	__type(key, struct cache_key);
+	__type(value, struct cache_stat);
+} stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_CGROUPS);
+	__type(key, __u64);
+	__type(value, struct cache_stat);
+} cgroups SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_PATHS);
+	__type(key, struct inode_key);
+	__type(value, struct file_path);
+} paths SEC(".maps");
+
+static struct cache_stat zero_stat;
+
+static __always_inline void account(struct inode *inode, __u64 cgid,
+				    enum cache_event ev)
+{
+	struct cache_key key = { .cgid = cgid };
+	struct cache_stat *st;
+
+	st = map_lookup_or_try_init(&cgroups, &cgid, &zero_stat);
+	if (st)
+		__sync_fetch_and_add(&st->count[ev], 1);
+
+	if (!inode || (targ_cgid && cgid != targ_cgid))
+		return;
+
+	inode_key_of(&key.inode, inode);
+	st = map_lookup_or_try_init(&stats, &key, &zero_stat);
+	if (st)
+		__sync_fetch_and_add(&st->count[ev], 1);
+}
+
+SEC("fentry/folio_mark_accessed")
+int BPF_PROG(mark_accessed, struct folio *folio)
+{
+	account(folio_inode(folio), folio_memcg_id(folio), CACHE_ACCESS);
+	return 0;
+}
+
+SEC("tp_btf/mm_filemap_add_to_page_cache")
+int BPF_PROG(add_to_page_cache, struct folio *folio)
+{
+	account(folio_inode(folio), folio_memcg_id(folio), CACHE_ADD);
+	return 0;
+}
+
+SEC("tp_btf/writeback_dirty_folio")
+int BPF_PROG(dirty_folio, struct folio *folio, struct address_space *mapping)
+{
+	account(BPF_CORE_READ(mapping, host), folio_memcg_id(folio),
+		CACHE_DIRTY);
+	return 0;
+}
+
+SEC("tp_btf/mm_filemap_delete_from_page_cache")
+int BPF_PROG(delete_from_page_cache, struct folio *folio)
+{
+	account(folio_inode(folio), folio_memcg_id(folio), CACHE_EVICT);
+	return 0;
+}
+
+SEC("fentry/filemap_read")
+int BPF_PROG(filemap_read, struct kiocb *iocb)
+{
+	path_note(&paths, iocb->ki_filp);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Helpers shared by every BPF object under src/bpf.
+ *
+ * Everything here is header-only and __always_inline so that each object
+ * stays self-contained for the skeleton generator.
+ */
+#ifndef __CX_COMMON_H
+#define __CX_COMMON_H
+
+#define TASK_COMM_LEN	16
+#define MAX_SLOTS	32
+
+#ifndef EEXIST
+#define EEXIST		17
+#endif
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+/* log2 buckets: slot n counts values in [2^(n-1), 2^n). */
+struct hist {
+	__u32 slots[MAX_SLOTS];
+};
+
+static __always_inline __u64 log2_u32(__u32 v)
+{
+	__u32 shift, r;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+	return r;
+}
+
+static __always_inline __u64 log2_u64(__u64 v)
+{
+	__u32 hi = v >> 32;
+
+	if (hi)
+		return log2_u32(hi) + 32 + 1;
+	return log2_u32(v) + 1;
+}
+
+/* Histograms live in shared (non per-CPU) maps, hence the atomic add. */
+static __always_inline void hist_add(struct hist *h, __u64 v)
+{
+	__u64 slot = v ? log2_u64(v) : 0;
+
+	if (slot >= MAX_SLOTS)
+		slot = MAX_SLOTS - 1;
+	__sync_fetch_and_add(&h->slots[slot], 1);
+}
+
+/* Racy by design: a lost update only under-reports a concurrent peak. */
+static __always_inline void max_store(__u64 *dst, __u64 v)
+{
+	if (v > *dst)
+		*dst = v;
+}
+
+/*
+ * Look up @key in @map, inserting @init first if it is missing.  Used for
+ * aggregation maps where the first event for a key creates the slot.
+ */
+static __always_inline void *
+map_lookup_or_try_init(void *map, const void *key, const void *init)
+{
+	void *val;
+	long err;
+
+	val = bpf_map_lookup_elem(map, key);
+	if (val)
+		return val;
+
+	err = bpf_map_update_elem(map, key, init, BPF_NOEXIST);
+	if (err && err != -EEXIST)
+		return NULL;
+
+	return bpf_map_lookup_elem(map, key);
+}
+
+#endif /* __CX_COMMON_H */
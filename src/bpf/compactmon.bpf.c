@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: MIT
+/*
+ * compactmon: compaction effort and fragmentation events per zone.
+ *
+ * The compaction tracepoints only carry pfns, so user space fills
+ * `zones` from /proc/zoneinfo (start_pfn, spanned) before load and every
+ * event is mapped to a zone by pfn.  Each zone keeps a ring of
+ * SERIES_LEN windows of interval_ns; a slot is reset when its window
+ * epoch changes, so the map itself is the time series and a reader only
+ * has to poll once every SERIES_LEN windows.
+ *
+ *	runs/sync/ns		mm_compaction_begin -> mm_compaction_end
+ *	status[]		mm_compaction_end result (enum compact_result)
+ *	scanned/isolated	mm_compaction_isolate_{migrate,free}pages
+ *	migrated/failed		mm_compaction_migratepages
+ *	extfrag			mm_page_alloc_extfrag, per allocation order,
+ *				and how many stole a whole pageblock
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_ZONES	32
+#define MAX_TASKS	4096
+#define SERIES_LEN	64
+#define MAX_STATUS	16
+#define MAX_ORDER_NR	11
+
+struct zone_range {
+	__u64 start_pfn;
+	__u64 end_pfn;
+	__u32 nid;
+	__u32 zid;
+};
+
+const volatile __u32 nr_zones = 0;
+const volatile struct zone_range zones[MAX_ZONES] = {};
+const volatile __u64 interval_ns = 10 * NSEC_PER_SEC;
+
+struct compact_run {
+	__u64 start_ns;
+	__u32 zone;
+	__u32 pad;
+};
+
+struct zone_window {
+	__u64 epoch;
+	__u64 runs;
+	__u64 sync_runs;
+	__u64 ns;
+	__u64 scanned;
+	__u64 isolated;
+	__u64 migrated;
+	__u64 failed;
+	__u64 status[MAX_STATUS];
+	__u64 extfrag[MAX_ORDER_NR];
+	__u64 extfrag_steal;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct compact_run);
+} running SEC(".maps");
+
+/* Index: zone * SERIES_LEN + epoch % SERIES_LEN. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_ZONES * SERIES_LEN);
+	__type(key, __u32);
+	__type(value, struct zone_window);
+} series SEC(".maps");
+
+static __always_inline int zone_of(__u64 pfn)
+{
+	int i;
+
+	for (i = 0; i < MAX_ZONES; i++) {
+		if ((__u32)i >= nr_zones)
+			break;
+		if (pfn >= zones[i].start_pfn && pfn < zones[i].end_pfn)
+			return i;
+	}
+	return -1;
+}
+
+static __always_inline struct zone_window *window_get(int zone)
+{
+	__u64 epoch = bpf_ktime_get_ns() / interval_ns;
+	struct zone_window *w;
+	__u32 idx;
+
+	if (zone < 0 || zone >= MAX_ZONES)
+		return NULL;
+
+	idx = zone * SERIES_LEN + epoch % SERIES_LEN;
+	w = bpf_map_lookup_elem(&series, &idx);
+	if (!w)
+		return NULL;
+
+	/* Racy reset: two CPUs opening a window may drop a few counts. */
+	if (w->epoch != epoch) {
+		__builtin_memset(w, 0, sizeof(*w));
+		w->epoch = epoch;
+	}
+	return w;
+}
+
+static __always_inline struct zone_window *current_window(void)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct compact_run *r;
+
+	r = bpf_map_lookup_elem(&running, &tid);
+	if (!r)
+		return NULL;
+	return window_get(r->zone);
+}
+
+SEC("tracepoint/compaction/mm_compaction_begin")
+int handle_begin(struct trace_event_raw_mm_compaction_begin *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct compact_run r = {};
+	struct zone_window *w;
+	int zone;
+
+	zone = zone_of(ctx->zone_start);
+	if (zone < 0)
+		return 0;
+
+	r.zone = zone;
+	r.start_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&running, &tid, &r, BPF_ANY);
+
+	w = window_get(zone);
+	if (!w)
+		return 0;
+
+	__sync_fetch_and_add(&w->runs, 1);
+	if (ctx->sync)
+		__sync_fetch_and_add(&w->sync_runs, 1);
+	return 0;
+}
+
+SEC("tracepoint/compaction/mm_compaction_end")
+int handle_end(struct trace_event_raw_mm_compaction_end *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct compact_run *r;
+	struct zone_window *w;
+	__u32 status;
+	__u64 delta;
+
+	r = bpf_map_lookup_elem(&running, &tid);
+	if (!r)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - r->start_ns;
+	w = window_get(r->zone);
+	bpf_map_delete_elem(&running, &tid);
+	if (!w)
+		return 0;
+
+	status = ctx->status;
+	__sync_fetch_and_add(&w->ns, delta);
+	if (status < MAX_STATUS)
+		__sync_fetch_and_add(&w->status[status], 1);
+	return 0;
+}
+
+SEC("tracepoint/compaction/mm_compaction_isolate_migratepages")
+int handle_isolate_migrate(struct trace_event_raw_mm_compaction_isolate_template *ctx)
+{
+	struct zone_window *w = current_window();
+
+	if (w) {
+		__sync_fetch_and_add(&w->scanned, ctx->nr_scanned);
+		__sync_fetch_and_add(&w->isolated, ctx->nr_taken);
+	}
+	return 0;
+}
+
+SEC("tracepoint/compaction/mm_compaction_isolate_freepages")
+int handle_isolate_free(struct trace_event_raw_mm_compaction_isolate_template *ctx)
+{
+	struct zone_window *w = current_window();
+
+	if (w)
+		__sync_fetch_and_add(&w->scanned, ctx->nr_scanned);
+	return 0;
+}
+
+SEC("tracepoint/compaction/mm_compaction_migratepages")
+int handle_migratepages(struct trace_event_raw_mm_compaction_migratepages *ctx)
+{
+	struct zone_window *w = current_window();
+
+	if (w) {
+		__sync_fetch_and_add(&w->migrated, ctx->nr_migrated);
+		__sync_fetch_and_add(&w->failed, ctx->nr_failed);
+	}
+	return 0;
+}
+
+SEC("tracepoint/kmem/mm_page_alloc_extfrag")
+int handle_extfrag(struct trace_event_raw_mm_page_alloc_extfrag *ctx)
+{
+	struct zone_window *w = window_get(zone_of(ctx->pfn));
+	__u32 order = ctx->alloc_order;
+
+	if (!w)
+		return 0;
+
+	if (order >= MAX_ORDER_NR)
+		order = MAX_ORDER_NR - 1;
+	__sync_fetch_and_add(&w->extfrag[order], 1);
+	if (ctx->change_ownership)
+		__sync_fetch_and_add(&w->extfrag_steal, 1);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: MIT
+/*
+ * cpunoise: per-CPU interference budget for isolated CPUs.
+ *
+ * Three noise sources are folded into one per-CPU record:
+ *
+ *	irq	irq_handler_entry/exit (or osnoise:irq_noise)
+ *	softirq	softirq_entry/exit (or osnoise:softirq_noise)
+ *	switch	time a foreign task ran after an unexpected sched_switch
+ *
+ * By default the irq/softirq entry/exit tracepoints are timed here.  The
+ * osnoise tracepoints only fire while the osnoise or timerlat tracer is
+ * running, and the osnoise tracer parks a busy-looping thread on every CPU,
+ * displacing the very workload being measured; set use_osnoise only when
+ * one of those tracers is armed anyway.  Both sets check the flag so a
+ * stray attachment does not double count.
+ *
+ * Nested time is only counted once: a softirq's duration excludes the
+ * hardirqs taken while it ran, and switch noise excludes the irq and
+ * softirq time taken while the foreign task was on the CPU.
+ *
+ * Noise is summed over fixed windows.  A window whose total exceeds
+ * budget_ns bumps windows_over, so user space can print the CPU ranges
+ * that broke the budget without streaming individual events.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_CPUS	1024
+#define PF_KTHREAD	0x00200000
+
+enum noise_src {
+	NOISE_IRQ,
+	NOISE_SOFTIRQ,
+	NOISE_SWITCH,
+	NOISE_MAX,
+};
+
+const volatile bool use_osnoise = false;
+/* When set, only CPUs in cpu_mask are accounted. */
+const volatile bool filter_cpus = false;
+const volatile __u64 cpu_mask[MAX_CPUS / 64] = {};
+/* Tasks of this tgid are the workload; 0 treats kthreads as noise. */
+const volatile __u32 workload_tgid = 0;
+const volatile __u64 window_ns = NSEC_PER_SEC;
+const volatile __u64 budget_ns = 10 * NSEC_PER_USEC;
+
+struct cpu_noise {
+	__u64 count[NOISE_MAX];
+	__u64 total_ns[NOISE_MAX];
+	__u64 max_ns[NOISE_MAX];
+	__u64 window_start;
+	__u64 window_noise;
+	__u64 windows;
+	__u64 windows_over;
+	__u64 worst_window_ns;
+	struct hist hist;
+};
+
+struct cpu_state {
+	__u64 irq_start;
+	__u64 softirq_start;
+	__u64 foreign_start;
+	/* irq time inside the running softirq */
+	__u64 softirq_nested;
+	/* irq and softirq time inside the running foreign task */
+	__u64 foreign_nested;
+};
+
+/* Each CPU only ever touches its own slot. */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CPUS);
+	__type(key, __u32);
+	__type(value, struct cpu_noise);
+} noise SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct cpu_state);
+} state SEC(".maps");
+
+static __always_inline bool cpu_wanted(__u32 cpu)
+{
+	if (!filter_cpus)
+		return true;
+	if (cpu >= MAX_CPUS)
+		return false;
+	return cpu_mask[cpu / 64] & (1ULL << (cpu % 64));
+}
+
+static __always_inline struct cpu_state *state_get(void)
+{
+	__u32 zero = 0;
+
+	return bpf_map_lookup_elem(&state, &zero);
+}
+
+static __always_inline void window_roll(struct cpu_noise *n, __u64 now)
+{
+	if (now - n->window_start < window_ns)
+		return;
+
+	if (n->window_start) {
+		n->windows++;
+		if (n->window_noise > budget_ns)
+			n->windows_over++;
+		max_store(&n->worst_window_ns, n->window_noise);
+	}
+	n->window_start = now;
+	n->window_noise = 0;
+}
+
+static __always_inline void account(enum noise_src src, __u64 duration)
+{
+	__u32 cpu = bpf_get_smp_processor_id();
+	struct cpu_noise *n;
+
+	if (!cpu_wanted(cpu))
+		return;
+
+	n = bpf_map_lookup_elem(&noise, &cpu);
+	if (!n)
+		return;
+
+	window_roll(n, bpf_ktime_get_ns());
+	n->window_noise += duration;
+	n->count[src]++;
+	n->total_ns[src] += duration;
+	max_store(&n->max_ns[src], duration);
+	hist_add(&n->hist, duration / NSEC_PER_USEC);
+}
+
+/* Charge interrupt time to the foreign task it interrupted, if any. */
+static __always_inline void foreign_nest(struct cpu_state *s, __u64 duration)
+{
+	if (s->foreign_start)
+		s->foreign_nested += duration;
+}
+
+/* osnoise already discounts irqs from its softirq durations. */
+SEC("tracepoint/osnoise/irq_noise")
+int handle_irq_noise(struct trace_event_raw_irq_noise *ctx)
+{
+	struct cpu_state *s;
+
+	if (!use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (s)
+		foreign_nest(s, ctx->duration);
+	account(NOISE_IRQ, ctx->duration);
+	return 0;
+}
+
+SEC("tracepoint/osnoise/softirq_noise")
+int handle_softirq_noise(struct trace_event_raw_softirq_noise *ctx)
+{
+	struct cpu_state *s;
+
+	if (!use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (s)
+		foreign_nest(s, ctx->duration);
+	account(NOISE_SOFTIRQ, ctx->duration);
+	return 0;
+}
+
+SEC("tracepoint/irq/irq_handler_entry")
+int handle_irq_entry(void *ctx)
+{
+	struct cpu_state *s;
+
+	if (use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (s)
+		s->irq_start = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("tracepoint/irq/irq_handler_exit")
+int handle_irq_exit(void *ctx)
+{
+	struct cpu_state *s;
+	__u64 duration;
+
+	if (use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (!s || !s->irq_start)
+		return 0;
+
+	duration = bpf_ktime_get_ns() - s->irq_start;
+	s->irq_start = 0;
+	if (s->softirq_start)
+		s->softirq_nested += duration;
+	foreign_nest(s, duration);
+	account(NOISE_IRQ, duration);
+	return 0;
+}
+
+SEC("tracepoint/irq/softirq_entry")
+int handle_softirq_entry(void *ctx)
+{
+	struct cpu_state *s;
+
+	if (use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (s) {
+		s->softirq_start = bpf_ktime_get_ns();
+		s->softirq_nested = 0;
+	}
+	return 0;
+}
+
+SEC("tracepoint/irq/softirq_exit")
+int handle_softirq_exit(void *ctx)
+{
+	struct cpu_state *s;
+	__u64 duration;
+
+	if (use_osnoise)
+		return 0;
+
+	s = state_get();
+	if (!s || !s->softirq_start)
+		return 0;
+
+	duration = bpf_ktime_get_ns() - s->softirq_start;
+	s->softirq_start = 0;
+	if (duration > s->softirq_nested)
+		duration -= s->softirq_nested;
+	else
+		duration = 0;
+	foreign_nest(s, duration);
+	account(NOISE_SOFTIRQ, duration);
+	return 0;
+}
+
+static __always_inline bool is_foreign(struct task_struct *t)
+{
+	if (!t->pid)
+		return false;
+	if (workload_tgid)
+		return (__u32)t->tgid != workload_tgid;
+	return t->flags & PF_KTHREAD;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt, struct task_struct *prev,
+	     struct task_struct *next)
+{
+	__u64 now = bpf_ktime_get_ns();
+	struct cpu_state *s;
+	__u64 duration;
+
+	if (!cpu_wanted(bpf_get_smp_processor_id()))
+		return 0;
+
+	s = state_get();
+	if (!s)
+		return 0;
+
+	if (s->foreign_start && is_foreign(prev)) {
+		duration = now - s->foreign_start;
+		if (duration > s->foreign_nested)
+			account(NOISE_SWITCH, duration - s->foreign_nested);
+		s->foreign_start = 0;
+	}
+	if (is_foreign(next)) {
+		s->foreign_start = now;
+		s->foreign_nested = 0;
+	}
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
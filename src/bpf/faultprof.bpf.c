@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: MIT
+/*
+ * faultprof: page faults per process, VMA kind, code location and file.
+ *
+ * handle_mm_fault() is bracketed with fentry/fexit for latency and the
+ * VM_FAULT_MAJOR result bit.  The VMA is classified on entry, while the
+ * fault still pins it; by exit the lock may have been dropped for a
+ * retry.  A VM_FAULT_RETRY or VM_FAULT_COMPLETED return only counts in
+ * `retries`; a retried attempt's time and major bit are carried into the
+ * attempt that finishes the fault, so each fault is counted once.  Three
+ * tables come out of it:
+ *
+ *	procs	(tgid, vma kind)	minor/major counts and latency
+ *	sites	(tgid, user ip)		faults per faulting instruction
+ *	files	(dev, ino)		major faults and filemap_fault calls,
+ *					with the dentry name seen first
+ *
+ * mm_filemap_fault counts page cache lookups that had to go through
+ * filemap_fault(), i.e. the faults that were not mapped by fault-around.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_TASKS	65536
+#define MAX_PROCS	16384
+#define MAX_SITES	65536
+#define MAX_FILES	16384
+#define FILE_NAME_LEN	32
+
+#define VM_SHARED	0x00000008
+#define VM_GROWSDOWN	0x00000100
+#define VM_HUGETLB	0x00400000
+#define TMPFS_MAGIC	0x01021994
+
+enum vma_kind {
+	VMA_ANON,
+	VMA_FILE,
+	VMA_SHMEM,
+	VMA_STACK,
+	VMA_HUGETLB,
+};
+
+const volatile __u32 targ_tgid = 0;
+const volatile bool by_site = true;
+
+struct file_key {
+	__u32 dev;
+	__u32 pad;
+	__u64 ino;
+};
+
+struct fault_start {
+	__u64 ts;
+	__u64 ip;
+	struct file_key file;
+	__u32 kind;
+	/* Left by an attempt that returned VM_FAULT_RETRY. */
+	__u32 carried_major;
+	__u64 carried_ns;
+};
+
+struct proc_key {
+	__u32 tgid;
+	__u32 kind;
+};
+
+struct proc_stat {
+	__u64 minor;
+	__u64 major;
+	__u64 retries;
+	__u64 minor_ns;
+	__u64 major_ns;
+	char comm[TASK_COMM_LEN];
+	struct hist minor_hist;
+	struct hist major_hist;
+};
+
+struct site_key {
+	__u64 ip;
+	__u32 tgid;
+	__u32 kind;
+};
+
+struct site_stat {
+	__u64 count;
+	__u64 major;
+	__u64 total_ns;
+};
+
+struct file_stat {
+	__u64 major;
+	__u64 minor;
+	__u64 major_ns;
+	__u64 filemap_faults;
+	char name[FILE_NAME_LEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct fault_start);
+} start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROCS);
+	__type(key, struct proc_key);
+	__type(value, struct proc_stat);
+} procs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_SITES);
+	__type(key, struct site_key);
+	__type(value, struct site_stat);
+} sites SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FILES);
+	__type(key, struct file_key);
+	__type(value, struct file_stat);
+} files SEC(".maps");
+
+static struct proc_stat zero_proc;
+static struct site_stat zero_site;
+static struct file_stat zero_file;
+
+static __always_inline __u32 vma_kind(struct vm_area_struct *vma,
+				      struct file *file)
+{
+	__u64 flags = vma->vm_flags;
+
+	if (flags & VM_HUGETLB)
+		return VMA_HUGETLB;
+	if (!file)
+		return flags & VM_GROWSDOWN ? VMA_STACK : VMA_ANON;
+	if ((flags & VM_SHARED) &&
+	    file->f_inode->i_sb->s_magic == TMPFS_MAGIC)
+		return VMA_SHMEM;
+	return VMA_FILE;
+}
+
+static __always_inline void file_note(struct file_key *key, struct file *file)
+{
+	struct file_stat *fs;
+
+	if (bpf_map_lookup_elem(&files, key))
+		return;
+
+	fs = map_lookup_or_try_init(&files, key, &zero_file);
+	if (fs)
+		bpf_probe_read_kernel_str(fs->name, sizeof(fs->name),
+					  file->f_path.dentry->d_name.name);
+}
+
+SEC("fentry/handle_mm_fault")
+int BPF_PROG(fault_enter, struct vm_area_struct *vma, unsigned long address,
+	     unsigned int flags, struct pt_regs *regs)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u32 tid = (__u32)pid_tgid;
+	struct fault_start s = {}, *prev;
+	struct file *file;
+
+	if (targ_tgid && (pid_tgid >> 32) != targ_tgid)
+		return 0;
+
+	prev = bpf_map_lookup_elem(&start, &tid);
+	if (prev) {
+		s.carried_major = prev->carried_major;
+		s.carried_ns = prev->carried_ns;
+	}
+
+	file = vma->vm_file;
+	s.kind = vma_kind(vma, file);
+	if (regs && (flags & FAULT_FLAG_USER))
+		s.ip = PT_REGS_IP(regs);
+	if (file) {
+		s.file.dev = file->f_inode->i_sb->s_dev;
+		s.file.ino = file->f_inode->i_ino;
+		file_note(&s.file, file);
+	}
+
+	s.ts = bpf_ktime_get_ns();
+	bpf_map_update_elem(&start, &tid, &s, BPF_ANY);
+	return 0;
+}
+
+SEC("fexit/handle_mm_fault")
+int BPF_PROG(fault_exit, struct vm_area_struct *vma, unsigned long address,
+	     unsigned int flags, struct pt_regs *regs, vm_fault_t ret)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u32 tid = (__u32)pid_tgid;
+	struct proc_key pkey = { .tgid = pid_tgid >> 32 };
+	struct site_key skey = { .tgid = pid_tgid >> 32 };
+	bool major = ret & VM_FAULT_MAJOR;
+	struct fault_start *s;
+	struct file_stat *fs;
+	struct site_stat *ss;
+	struct proc_stat *ps;
+	__u64 delta;
+
+	s = bpf_map_lookup_elem(&start, &tid);
+	if (!s)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - s->ts;
+	pkey.kind = s->kind;
+
+	ps = bpf_map_lookup_elem(&procs, &pkey);
+	if (!ps) {
+		ps = map_lookup_or_try_init(&procs, &pkey, &zero_proc);
+		if (ps)
+			bpf_get_current_comm(ps->comm, sizeof(ps->comm));
+	}
+
+	if (ret & (VM_FAULT_RETRY | VM_FAULT_COMPLETED)) {
+		if (ps)
+			__sync_fetch_and_add(&ps->retries, 1);
+		if (ret & VM_FAULT_RETRY) {
+			s->carried_major |= major;
+			s->carried_ns += delta;
+		} else {
+			bpf_map_delete_elem(&start, &tid);
+		}
+		return 0;
+	}
+
+	major |= s->carried_major;
+	delta += s->carried_ns;
+	if (ps) {
+		if (major) {
+			__sync_fetch_and_add(&ps->major, 1);
+			__sync_fetch_and_add(&ps->major_ns, delta);
+			hist_add(&ps->major_hist, delta / NSEC_PER_USEC);
+		} else {
+			__sync_fetch_and_add(&ps->minor, 1);
+			__sync_fetch_and_add(&ps->minor_ns, delta);
+			hist_add(&ps->minor_hist, delta / NSEC_PER_USEC);
+		}
+	}
+
+	if (by_site && s->ip) {
+		skey.ip = s->ip;
+		skey.kind = s->kind;
+		ss = map_lookup_or_try_init(&sites, &skey, &zero_site);
+		if (ss) {
+			__sync_fetch_and_add(&ss->count, 1);
+			__sync_fetch_and_add(&ss->total_ns, delta);
+			if (major)
+				__sync_fetch_and_add(&ss->major, 1);
+		}
+	}
+
+	if (s->file.ino) {
+		fs = bpf_map_lookup_elem(&files, &s->file);
+		if (fs && major) {
+			__sync_fetch_and_add(&fs->major, 1);
+			__sync_fetch_and_add(&fs->major_ns, delta);
+		} else if (fs) {
+			__sync_fetch_and_add(&fs->minor, 1);
+		}
+	}
+
+	bpf_map_delete_elem(&start, &tid);
+	return 0;
+}
+
+SEC("tracepoint/filemap/mm_filemap_fault")
+int handle_filemap_fault(struct trace_event_raw_mm_filemap_fault *ctx)
+{
+	struct file_key key = {
+		.dev = ctx->s_dev,
+		.ino = ctx->i_ino,
+	};
+	struct file_stat *fs;
+
+	if (targ_tgid && (bpf_get_current_pid_tgid() >> 32) != targ_tgid)
+		return 0;
+
+	fs = bpf_map_lookup_elem(&files, &key);
+	if (fs)
+		__sync_fetch_and_add(&fs->filemap_faults, 1);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: MIT
+/*
+ * hctxstat: blk-mq dispatch and in-flight depth per hardware queue, and
+ * plugging behaviour per device.
+ *
+ * Requests are counted on the blk_mq_hw_ctx they are issued to, keyed by
+ * (disk dev_t, queue_num):
+ *
+ *	dispatched/sectors	block_rq_issue
+ *	inflight/max_inflight	issued minus completed or requeued, as seen by
+ *				this tool
+ *	requeued		block_rq_requeue, issued again later
+ *	untracked		issues not counted in flight because `rqs` was
+ *				full
+ *	depth_hist		in-flight depth at each issue
+ *	hist			block_rq_issue -> block_rq_complete, in usec
+ *
+ * With 64 queues per NVMe device, the spread of dispatched over queue_num
+ * shows whether submitters are concentrated on a few CPUs' queues.  The
+ * plug side, per device:
+ *
+ *	plugs			block_plug, first request held back
+ *	unplugs/explicit	block_unplug, and how many came from
+ *				blk_finish_plug() rather than schedule()
+ *	unplug_depth		requests released per unplug
+ *	plug_hist		block_plug -> block_unplug on the same task
+ *
+ * In-flight only counts requests whose issue was recorded in `rqs`, so
+ * requests issued before attach and untracked ones never skew it.  `rqs`
+ * is a plain hash rather than an LRU so no entry leaves it without its
+ * request completing or being requeued; user space should still treat the
+ * first interval as warm-up.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "blk.h"
+
+#define MAX_HCTX	8192
+#define MAX_DEVS	1024
+#define MAX_RQS		65536
+#define MAX_TASKS	16384
+
+struct hctx_key {
+	__u32 dev;
+	__u32 queue;
+};
+
+struct hctx_stat {
+	__u64 dispatched;
+	__u64 completed;
+	__u64 requeued;
+	__u64 untracked;
+	__u64 sectors;
+	__s64 inflight;
+	__u64 max_inflight;
+	__u64 total_ns;
+	__u32 numa_node;
+	__u32 nr_hw_queues;
+	__u64 ops[MAX_REQ_OP];
+	struct hist depth_hist;
+	struct hist hist;
+};
+
+struct rq_start {
+	__u64 ts;
+	struct hctx_key hctx;
+};
+
+struct plug_stat {
+	__u64 plugs;
+	__u64 unplugs;
+	__u64 explicit;
+	__u64 plug_ns;
+	struct hist unplug_depth;
+	/* Plug to unplug on the same task, in microseconds. */
+	struct hist plug_hist;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_HCTX);
+	__type(key, struct hctx_key);
+	__type(value, struct hctx_stat);
+} hctxs SEC(".maps");
+
+/* Every entry here holds one count of its hctx's inflight. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_RQS);
+	__type(key, __u64);
+	__type(value, struct rq_start);
+} rqs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_DEVS);
+	__type(key, __u32);
+	__type(value, struct plug_stat);
+} plugs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} plugged SEC(".maps");
+
+static struct hctx_stat zero_hctx;
+static struct plug_stat zero_plug;
+
+/* Drops @rq's entry and its inflight count; returns the entry's hctx. */
+static __always_inline struct hctx_stat *rq_untrack(__u64 key, __u64 *start)
+{
+	struct hctx_stat *hs;
+	struct rq_start *s;
+
+	s = bpf_map_lookup_elem(&rqs, &key);
+	if (!s)
+		return NULL;
+
+	*start = s->ts;
+	hs = bpf_map_lookup_elem(&hctxs, &s->hctx);
+	bpf_map_delete_elem(&rqs, &key);
+	if (hs)
+		__sync_fetch_and_add(&hs->inflight, -1);
+	return hs;
+}
+
+SEC("tp_btf/block_rq_issue")
+int BPF_PROG(block_rq_issue, struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = BPF_CORE_READ(rq, mq_hctx);
+	struct request_queue *q = BPF_CORE_READ(rq, q);
+	struct rq_start s = {};
+	struct hctx_stat *hs;
+	__u64 key = (__u64)rq;
+	__u64 start;
+	__s64 depth;
+
+	if (!hctx)
+		return 0;
+
+	/* Issued again without a requeue we saw: drop the stale count. */
+	rq_untrack(key, &start);
+
+	s.ts = bpf_ktime_get_ns();
+	s.hctx.dev = queue_dev(q);
+	s.hctx.queue = BPF_CORE_READ(hctx, queue_num);
+
+	hs = bpf_map_lookup_elem(&hctxs, &s.hctx);
+	if (!hs) {
+		hs = map_lookup_or_try_init(&hctxs, &s.hctx, &zero_hctx);
+		if (!hs)
+			return 0;
+		hs->numa_node = BPF_CORE_READ(hctx, numa_node);
+		hs->nr_hw_queues = BPF_CORE_READ(q, nr_hw_queues);
+	}
+
+	__sync_fetch_and_add(&hs->dispatched, 1);
+	__sync_fetch_and_add(&hs->sectors, BPF_CORE_READ(rq, __data_len) >> 9);
+	__sync_fetch_and_add(&hs->ops[rq_op(rq)], 1);
+
+	if (bpf_map_update_elem(&rqs, &key, &s, BPF_NOEXIST)) {
+		__sync_fetch_and_add(&hs->untracked, 1);
+		return 0;
+	}
+
+	depth = __sync_add_and_fetch(&hs->inflight, 1);
+	if (depth > 0) {
+		max_store(&hs->max_inflight, depth);
+		hist_add(&hs->depth_hist, depth);
+	}
+	return 0;
+}
+
+SEC("tp_btf/block_rq_requeue")
+int BPF_PROG(block_rq_requeue, struct request *rq)
+{
+	struct hctx_stat *hs;
+	__u64 start;
+
+	hs = rq_untrack((__u64)rq, &start);
+	if (hs)
+		__sync_fetch_and_add(&hs->requeued, 1);
+	return 0;
+}
+
+SEC("tp_btf/block_rq_complete")
+int BPF_PROG(block_rq_complete, struct request *rq, blk_status_t error,
+	     unsigned int nr_bytes)
+{
+	struct hctx_stat *hs;
+	__u64 start, delta;
+
+	hs = rq_untrack((__u64)rq, &start);
+	if (!hs)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - start;
+	__sync_fetch_and_add(&hs->completed, 1);
+	__sync_fetch_and_add(&hs->total_ns, delta);
+	hist_add(&hs->hist, delta / NSEC_PER_USEC);
+	return 0;
+}
+
+SEC("tp_btf/block_plug")
+int BPF_PROG(block_plug, struct request_queue *q)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u32 dev = queue_dev(q);
+	__u64 now = bpf_ktime_get_ns();
+	struct plug_stat *ps;
+
+	ps = map_lookup_or_try_init(&plugs, &dev, &zero_plug);
+	if (ps)
+		__sync_fetch_and_add(&ps->plugs, 1);
+	bpf_map_update_elem(&plugged, &tid, &now, BPF_NOEXIST);
+	return 0;
+}
+
+SEC("tp_btf/block_unplug")
+int BPF_PROG(block_unplug, struct request_queue *q, unsigned int depth,
+	     bool explicit)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u32 dev = queue_dev(q);
+	struct plug_stat *ps;
+	__u64 *tsp, delta;
+
+	ps = map_lookup_or_try_init(&plugs, &dev, &zero_plug);
+	if (!ps)
+		return 0;
+
+	__sync_fetch_and_add(&ps->unplugs, 1);
+	if (explicit)
+		__sync_fetch_and_add(&ps->explicit, 1);
+	hist_add(&ps->unplug_depth, depth);
+
+	tsp = bpf_map_lookup_elem(&plugged, &tid);
+	if (!tsp)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - *tsp;
+	bpf_map_delete_elem(&plugged, &tid);
+	__sync_fetch_and_add(&ps->plug_ns, delta);
+	hist_add(&ps->plug_hist, delta / NSEC_PER_USEC);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: MIT
+/*
+ * idlelat: idle-state residency and frequency caps vs wakeup latency.
+ *
+ * Two families of histograms share the (cpu, state) key so user space can
+ * join them row by row:
+ *
+ *	residency	time spent in each idle state (power:cpu_idle)
+ *	wakeup		sched_wakeup -> sched_switch latency of tasks that ran
+ *			on that CPU, keyed by the idle state the CPU left to
+ *			run them (STATE_BUSY if it was not idle) and by the
+ *			frequency band the CPU was running at
+ *
+ * Per-CPU counters add cpu_idle_miss (governor picked a too deep or too
+ * shallow state) and cpu_frequency_limits changes, with the time the CPU
+ * spent capped below freq_ceiling_khz.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_CPUS	1024
+#define MAX_TASKS	65536
+#define MAX_KEYS	16384
+#define PWR_EVENT_EXIT	((__u32)-1)
+#define STATE_BUSY	0xff
+#define FREQ_BANDS	16
+
+/* Width of a frequency band in kHz; the last band is open ended. */
+const volatile __u32 freq_band_khz = 500000;
+/* Hardware max frequency; a lower max_freq limit counts as capped. */
+const volatile __u32 freq_ceiling_khz = 0;
+
+struct cpu_pm {
+	__u32 cur_freq;
+	__u32 min_freq;
+	__u32 max_freq;
+	__u32 idle_state;
+	__u64 idle_enter_ns;
+	__u32 last_state;
+	__u32 pad;
+	__u64 limit_changes;
+	__u64 capped_since;
+	__u64 capped_ns;
+	__u64 miss_above;
+	__u64 miss_below;
+};
+
+struct state_key {
+	__u32 cpu;
+	__u32 state;
+};
+
+struct residency {
+	__u64 count;
+	__u64 total_ns;
+	struct hist hist;
+};
+
+struct wakeup_key {
+	__u32 cpu;
+	__u32 state;
+	__u32 freq_band;
+};
+
+struct wakeup_lat {
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+	struct hist hist;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CPUS);
+	__type(key, __u32);
+	__type(value, struct cpu_pm);
+} cpus SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_KEYS);
+	__type(key, struct state_key);
+	__type(value, struct residency);
+} residency SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_KEYS);
+	__type(key, struct wakeup_key);
+	__type(value, struct wakeup_lat);
+} wakeup SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} woken SEC(".maps");
+
+static struct residency zero_res;
+static struct wakeup_lat zero_lat;
+
+static __always_inline struct cpu_pm *cpu_get(__u32 cpu)
+{
+	return bpf_map_lookup_elem(&cpus, &cpu);
+}
+
+SEC("tracepoint/power/cpu_idle")
+int handle_cpu_idle(struct trace_event_raw_cpu *ctx)
+{
+	struct state_key key = { .cpu = ctx->cpu_id };
+	__u64 now = bpf_ktime_get_ns();
+	struct residency *r;
+	struct cpu_pm *pm;
+	__u64 delta;
+
+	pm = cpu_get(ctx->cpu_id);
+	if (!pm)
+		return 0;
+
+	if (ctx->state != PWR_EVENT_EXIT) {
+		pm->idle_state = ctx->state;
+		pm->idle_enter_ns = now;
+		return 0;
+	}
+
+	if (!pm->idle_enter_ns)
+		return 0;
+
+	delta = now - pm->idle_enter_ns;
+	key.state = pm->idle_state;
+	pm->last_state = pm->idle_state;
+	pm->idle_enter_ns = 0;
+
+	r = map_lookup_or_try_init(&residency, &key, &zero_res);
+	if (!r)
+		return 0;
+
+	__sync_fetch_and_add(&r->count, 1);
+	__sync_fetch_and_add(&r->total_ns, delta);
+	hist_add(&r->hist, delta / NSEC_PER_USEC);
+	return 0;
+}
+
+SEC("tracepoint/power/cpu_idle_miss")
+int handle_cpu_idle_miss(struct trace_event_raw_cpu_idle_miss *ctx)
+{
+	struct cpu_pm *pm = cpu_get(ctx->cpu_id);
+
+	if (!pm)
+		return 0;
+
+	if (ctx->below)
+		__sync_fetch_and_add(&pm->miss_below, 1);
+	else
+		__sync_fetch_and_add(&pm->miss_above, 1);
+	return 0;
+}
+
+SEC("tracepoint/power/cpu_frequency")
+int handle_cpu_frequency(struct trace_event_raw_cpu *ctx)
+{
+	struct cpu_pm *pm = cpu_get(ctx->cpu_id);
+
+	if (pm)
+		pm->cur_freq = ctx->state;
+	return 0;
+}
+
+SEC("tracepoint/power/cpu_frequency_limits")
+int handle_cpu_frequency_limits(struct trace_event_raw_cpu_frequency_limits *ctx)
+{
+	struct cpu_pm *pm = cpu_get(ctx->cpu_id);
+	__u64 now = bpf_ktime_get_ns();
+	bool capped;
+
+	if (!pm)
+		return 0;
+
+	capped = freq_ceiling_khz && ctx->max_freq < freq_ceiling_khz;
+	if (pm->capped_since && !capped) {
+		pm->capped_ns += now - pm->capped_since;
+		pm->capped_since = 0;
+	} else if (!pm->capped_since && capped) {
+		pm->capped_since = now;
+	}
+
+	pm->min_freq = ctx->min_freq;
+	pm->max_freq = ctx->max_freq;
+	pm->limit_changes++;
+	return 0;
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(handle_sched_wakeup, struct task_struct *p)
+{
+	__u32 pid = p->pid;
+	__u64 now = bpf_ktime_get_ns();
+
+	bpf_map_update_elem(&woken, &pid, &now, BPF_ANY);
+	return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(handle_sched_wakeup_new, struct task_struct *p)
+{
+	__u32 pid = p->pid;
+	__u64 now = bpf_ktime_get_ns();
+
+	bpf_map_update_elem(&woken, &pid, &now, BPF_ANY);
+	return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt, struct task_struct *prev,
+	     struct task_struct *next)
+{
+	__u32 cpu = bpf_get_smp_processor_id();
+	struct wakeup_key key = { .cpu = cpu };
+	__u64 now = bpf_ktime_get_ns();
+	struct wakeup_lat *lat;
+	__u32 pid = next->pid;
+	struct cpu_pm *pm;
+	__u64 *tsp, delta;
+
+	tsp = bpf_map_lookup_elem(&woken, &pid);
+	if (!tsp)
+		return 0;
+
+	delta = now - *tsp;
+	pm = cpu_get(cpu);
+	if (pm) {
+		/*
+		 * cpu_idle exit is traced before IRQs are re-enabled, so the
+		 * wakeup usually comes after it; switching away from the idle
+		 * task is what says the CPU was idle for this task.
+		 */
+		key.state = prev->pid == 0 ? pm->last_state : STATE_BUSY;
+		key.freq_band = freq_band_khz ? pm->cur_freq / freq_band_khz
+					      : 0;
+		if (key.freq_band >= FREQ_BANDS)
+			key.freq_band = FREQ_BANDS - 1;
+	}
+	bpf_map_delete_elem(&woken, &pid);
+
+	lat = map_lookup_or_try_init(&wakeup, &key, &zero_lat);
+	if (!lat)
+		return 0;
+
+	__sync_fetch_and_add(&lat->count, 1);
+	__sync_fetch_and_add(&lat->total_ns, delta);
+	max_store(&lat->max_ns, delta);
+	hist_add(&lat->hist, delta / NSEC_PER_USEC);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
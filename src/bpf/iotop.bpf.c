@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: MIT
+/*
+ * iotop: block I/O bytes and device time per (cgroup, pid, direction),
+ * aggregated in the kernel so short-lived processes are not missed.
+ *
+ * The owner of an I/O is decided when its bio is queued: the submitting
+ * task, and the cgroup of the bio's blkg.  For writeback the submitter is
+ * a flusher worker inside wb_workfn(), so pid is 0 and the key is marked
+ * `wb`, but the blkg still carries the cgroup that dirtied the pages.
+ * Other kthreads that submit on someone's behalf (kcryptd, md raid
+ * threads, jbd2) are charged as themselves.  Bytes are counted when
+ * a request is issued to the device, so bios split or cloned by dm/md are
+ * not counted twice, and device time is block_rq_issue -> _complete:
+ *
+ *	ios/bytes	block_rq_issue, owner of the request's first bio
+ *	device_ns	block_rq_issue -> block_rq_complete
+ *
+ * Only READ, WRITE and ZONE_APPEND requests are counted: a discard,
+ * secure erase or write-zeroes has a __data_len but moves no data.  A
+ * requeued request keeps its entry in `rqs`, so its re-issue neither
+ * counts it again nor loses the owner; time until the requeue is device
+ * time.  A request is finished at the block_rq_complete that covers all
+ * its remaining bytes, not at a partial completion.
+ *
+ * Bios back-merged into another owner's request are charged to that
+ * owner; a front merge makes the bio the request's first, so the request
+ * is charged to the bio's owner instead.  A bio's owner entry goes away
+ * when its request is issued, when it is back-merged, or at the latest at
+ * block_bio_complete, which also covers bios that never reach a request
+ * (dm/md top-level bios), so `owners` only holds bios still in flight.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "blk.h"
+
+#define MAX_BIOS	65536
+#define MAX_RQS		65536
+#define MAX_STAT	65536
+#define MAX_FLUSHERS	1024
+
+struct io_key {
+	__u64 cgid;
+	__u32 pid;
+	__u8 write;
+	__u8 wb;
+	__u16 pad;
+};
+
+struct io_stat {
+	__u64 ios;
+	__u64 bytes;
+	__u64 device_ns;
+	char comm[TASK_COMM_LEN];
+};
+
+struct bio_owner {
+	struct io_key key;
+	char comm[TASK_COMM_LEN];
+};
+
+struct rq_start {
+	__u64 ts;
+	struct io_key key;
+	__u8 requeued;
+};
+
+/* Bios lost from this table are charged to their cgroup with pid 0. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_BIOS);
+	__type(key, __u64);
+	__type(value, struct bio_owner);
+} owners SEC(".maps");
+
+/* Threads currently running wb_workfn(). */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FLUSHERS);
+	__type(key, __u32);
+	__type(value, __u8);
+} flushers SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_RQS);
+	__type(key, __u64);
+	__type(value, struct rq_start);
+} rqs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct io_key);
+	__type(value, struct io_stat);
+} stats SEC(".maps");
+
+static struct io_stat zero_stat;
+
+static __always_inline __u64 bio_cgroup_id(struct bio *bio)
+{
+	struct blkcg_gq *blkg = BPF_CORE_READ(bio, bi_blkg);
+
+	if (!blkg)
+		return bpf_get_current_cgroup_id();
+	return BPF_CORE_READ(blkg, blkcg, css.cgroup, kn, id);
+}
+
+/* Ops that move data; ZONE_APPEND's value changed across kernels. */
+static __always_inline bool op_has_data(__u32 op)
+{
+	return op == REQ_OP_READ || op == REQ_OP_WRITE ||
+	       op == bpf_core_enum_value(enum req_op, REQ_OP_ZONE_APPEND);
+}
+
+static __always_inline bool op_is_write(__u32 op)
+{
+	return op != REQ_OP_READ;
+}
+
+SEC("fentry/wb_workfn")
+int BPF_PROG(wb_workfn_enter)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u8 one = 1;
+
+	bpf_map_update_elem(&flushers, &tid, &one, BPF_ANY);
+	return 0;
+}
+
+SEC("fexit/wb_workfn")
+int BPF_PROG(wb_workfn_exit)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+
+	bpf_map_delete_elem(&flushers, &tid);
+	return 0;
+}
+
+SEC("tp_btf/block_bio_queue")
+int BPF_PROG(block_bio_queue, struct bio *bio)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	__u32 tid = (__u32)pid_tgid;
+	struct bio_owner o = {};
+	__u64 key = (__u64)bio;
+
+	o.key.cgid = bio_cgroup_id(bio);
+	o.key.write = op_is_write(bio_op(bio));
+	if (bpf_map_lookup_elem(&flushers, &tid))
+		o.key.wb = 1;
+	else
+		o.key.pid = pid_tgid >> 32;
+	bpf_get_current_comm(o.comm, sizeof(o.comm));
+
+	/* dm/md clone in the submitter's context, so clones get its owner. */
+	bpf_map_update_elem(&owners, &key, &o, BPF_ANY);
+	return 0;
+}
+
+static __always_inline void owner_drop(struct bio *bio)
+{
+	__u64 key = (__u64)bio;
+
+	bpf_map_delete_elem(&owners, &key);
+}
+
+SEC("tp_btf/block_bio_backmerge")
+int BPF_PROG(block_bio_backmerge, struct bio *bio)
+{
+	owner_drop(bio);
+	return 0;
+}
+
+SEC("tp_btf/block_bio_complete")
+int BPF_PROG(block_bio_complete, struct request_queue *q, struct bio *bio)
+{
+	owner_drop(bio);
+	return 0;
+}
+
+SEC("tp_btf/block_rq_issue")
+int BPF_PROG(block_rq_issue, struct request *rq)
+{
+	struct bio *bio = BPF_CORE_READ(rq, bio);
+	struct rq_start s = {}, *prev;
+	struct bio_owner *o;
+	struct io_stat *st;
+	__u64 bkey = (__u64)bio;
+	__u64 rkey = (__u64)rq;
+
+	if (!bio)
+		return 0;
+
+	/* Re-issue after a requeue: already counted, only restart the clock. */
+	prev = bpf_map_lookup_elem(&rqs, &rkey);
+	if (prev && prev->requeued) {
+		prev->requeued = 0;
+		prev->ts = bpf_ktime_get_ns();
+		return 0;
+	}
+
+	if (!op_has_data(rq_op(rq))) {
+		owner_drop(bio);
+		return 0;
+	}
+
+	o = bpf_map_lookup_elem(&owners, &bkey);
+	if (o) {
+		s.key = o->key;
+	} else {
+		s.key.cgid = bio_cgroup_id(bio);
+		s.key.write = op_is_write(rq_op(rq));
+	}
+
+	st = bpf_map_lookup_elem(&stats, &s.key);
+	if (!st) {
+		st = map_lookup_or_try_init(&stats, &s.key, &zero_stat);
+		if (!st)
+			return 0;
+		if (o)
+			__builtin_memcpy(st->comm, o->comm, sizeof(st->comm));
+	}
+	if (o)
+		bpf_map_delete_elem(&owners, &bkey);
+
+	__sync_fetch_and_add(&st->ios, 1);
+	__sync_fetch_and_add(&st->bytes, BPF_CORE_READ(rq, __data_len));
+
+	s.ts = bpf_ktime_get_ns();
+	bpf_map_update_elem(&rqs, &rkey, &s, BPF_ANY);
+	return 0;
+}
+
+SEC("tp_btf/block_rq_requeue")
+int BPF_PROG(block_rq_requeue, struct request *rq)
+{
+	__u64 key = (__u64)rq;
+	struct rq_start *s;
+	struct io_stat *st;
+	__u64 delta;
+
+	s = bpf_map_lookup_elem(&rqs, &key);
+	if (!s || s->requeued)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - s->ts;
+	st = bpf_map_lookup_elem(&stats, &s->key);
+	if (st)
+		__sync_fetch_and_add(&st->device_ns, delta);
+	s->requeued = 1;
+	return 0;
+}
+
+SEC("tp_btf/block_rq_complete")
+int BPF_PROG(block_rq_complete, struct request *rq, blk_status_t error,
+	     unsigned int nr_bytes)
+{
+	__u64 key = (__u64)rq;
+	struct rq_start *s;
+	struct io_stat *st;
+	__u64 delta;
+
+	/* Traced before the request is advanced: __data_len is what is left. */
+	if (nr_bytes < BPF_CORE_READ(rq, __data_len))
+		return 0;
+
+	s = bpf_map_lookup_elem(&rqs, &key);
+	if (!s)
+		return 0;
+
+	/* Ended while requeued: its device time is already charged. */
+	if (!s->requeued) {
+		delta = bpf_ktime_get_ns() - s->ts;
+		st = bpf_map_lookup_elem(&stats, &s->key);
+		if (st)
+			__sync_fetch_and_add(&st->device_ns, delta);
+	}
+	bpf_map_delete_elem(&rqs, &key);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
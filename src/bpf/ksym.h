@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * In-kernel symbolisation through the kallsyms BPF iterator.
+ *
+ * Tracing programs record the code addresses they aggregate on with
+ * ksym_note().  Reading the "iter/ksym" link then prints one line per
+ * matching kallsyms entry:
+ *
+ *	<addr> <type> <name> [<module>]
+ *
+ * so user space resolves only the addresses the tool actually saw, without
+ * parsing /proc/kallsyms.  Stack traces hold return addresses rather than
+ * symbol starts; tools that symbolise stacks set ksym_all and get every
+ * text symbol instead, to build a range table from.  Include this header
+ * from exactly one .bpf.c.
+ */
+#ifndef __CX_KSYM_H
+#define __CX_KSYM_H
+
+#ifndef KSYM_MAX_ENTRIES
+#define KSYM_MAX_ENTRIES	16384
+#endif
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, KSYM_MAX_ENTRIES);
+	__type(key, __u64);
+	__type(value, __u8);
+} ksym_wanted SEC(".maps");
+
+const volatile bool ksym_all = false;
+
+static __always_inline bool ksym_is_text(char type)
+{
+	return type == 't' || type == 'T' || type == 'W';
+}
+
+/* Cheap enough for slow paths; callers skip it once a key is known. */
+static __always_inline void ksym_note(__u64 addr)
+{
+	__u8 one = 1;
+
+	if (addr)
+		bpf_map_update_elem(&ksym_wanted, &addr, &one, BPF_ANY);
+}
+
+SEC("iter/ksym")
+int dump_ksym(struct bpf_iter__ksym *ctx)
+{
+	struct seq_file *seq = ctx->meta->seq;
+	struct kallsym_iter *iter = ctx->ksym;
+	__u64 addr;
+
+	if (!iter)
+		return 0;
+
+	addr = iter->value;
+	if (ksym_all) {
+		if (!ksym_is_text(iter->type))
+			return 0;
+	} else if (!bpf_map_lookup_elem(&ksym_wanted, &addr)) {
+		return 0;
+	}
+
+	if (iter->module_name[0])
+		BPF_SEQ_PRINTF(seq, "%llx %c %s [%s]\n", addr, iter->type,
+			       iter->name, iter->module_name);
+	else
+		BPF_SEQ_PRINTF(seq, "%llx %c %s\n", addr, iter->type,
+			       iter->name);
+	return 0;
+}
+
+#endif /* __CX_KSYM_H */
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: MIT
+/*
+ * lockcon: kernel lock contention by lock class and caller stack.
+ *
+ * Wait time is measured between lock:contention_begin and
+ * lock:contention_end (5.19+).  On older kernels the loader disables the
+ * tp_btf programs and attaches the fentry/fexit pairs on the contended
+ * slow paths instead; both feed the same begin/end helpers.
+ *
+ * Waits are aggregated in-kernel per (class, flags, stack) and, with
+ * aggr_by_lock, per lock address too.  The class tells the well-known
+ * per-process locks apart (mmap_lock, siglock) without a debug kernel;
+ * anything else, zone->lock included, is told apart by its stack.
+ * Stacks are symbolised through the ksym iterator with ksym_all set.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_TASKS	16384
+#define MAX_STACKS	16384
+#define MAX_STAT	16384
+#define PERF_MAX_STACK_DEPTH	127
+
+/* From include/trace/events/lock.h. */
+#define LCB_F_SPIN	(1U << 0)
+#define LCB_F_READ	(1U << 1)
+#define LCB_F_WRITE	(1U << 2)
+#define LCB_F_RT	(1U << 3)
+#define LCB_F_PERCPU	(1U << 4)
+#define LCB_F_MUTEX	(1U << 5)
+
+enum lock_class {
+	LOCK_OTHER,
+	LOCK_MMAP,
+	LOCK_SIGHAND,
+};
+
+/* Frames belonging to the tracing machinery itself. */
+const volatile __u32 stack_skip = 3;
+const volatile bool aggr_by_lock = false;
+const volatile __u64 min_wait_ns = 0;
+
+struct wait {
+	__u64 lock;
+	__u64 start_ns;
+	__s32 stack_id;
+	__u32 flags;
+};
+
+struct lock_key {
+	__u64 lock;
+	__s32 stack_id;
+	__u32 flags;
+	__u32 class;
+	__u32 pad;
+};
+
+struct lock_stat {
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+	struct hist hist;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct wait);
+} waits SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(max_entries, MAX_STACKS);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct lock_key);
+	__type(value, struct lock_stat);
+} stats SEC(".maps");
+
+/* Lost to a full stack map or stats map; non-zero means resize. */
+__u64 dropped = 0;
+
+static struct lock_stat zero_stat;
+
+static __always_inline __u32 lock_class_of(__u64 lock)
+{
+	struct task_struct *task = bpf_get_current_task_btf();
+	struct mm_struct *mm = task->mm;
+
+	if (mm && lock == (__u64)&mm->mmap_lock)
+		return LOCK_MMAP;
+	if (lock == (__u64)&task->sighand->siglock)
+		return LOCK_SIGHAND;
+	return LOCK_OTHER;
+}
+
+static __always_inline void wait_begin(void *ctx, __u64 lock, __u32 flags)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct wait w = {
+		.lock = lock,
+		.flags = flags,
+	};
+
+	/* Nested contention (e.g. wait_lock inside a mutex): keep the outer. */
+	if (bpf_map_lookup_elem(&waits, &tid))
+		return;
+
+	w.stack_id = bpf_get_stackid(ctx, &stacks,
+				     stack_skip & BPF_F_SKIP_FIELD_MASK);
+	w.start_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&waits, &tid, &w, BPF_NOEXIST);
+}
+
+static __always_inline void wait_end(__u64 lock)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct lock_key key = {};
+	struct lock_stat *st;
+	struct wait *w;
+	__u64 delta;
+
+	w = bpf_map_lookup_elem(&waits, &tid);
+	if (!w || w->lock != lock)
+		return;
+
+	delta = bpf_ktime_get_ns() - w->start_ns;
+	key.stack_id = w->stack_id;
+	key.flags = w->flags;
+	bpf_map_delete_elem(&waits, &tid);
+
+	if (delta < min_wait_ns)
+		return;
+	if (key.stack_id < 0)
+		__sync_fetch_and_add(&dropped, 1);
+
+	key.class = lock_class_of(lock);
+	if (aggr_by_lock)
+		key.lock = lock;
+
+	st = map_lookup_or_try_init(&stats, &key, &zero_stat);
+	if (!st) {
+		__sync_fetch_and_add(&dropped, 1);
+		return;
+	}
+
+	__sync_fetch_and_add(&st->count, 1);
+	__sync_fetch_and_add(&st->total_ns, delta);
+	max_store(&st->max_ns, delta);
+	hist_add(&st->hist, delta / NSEC_PER_USEC);
+}
+
+SEC("tp_btf/contention_begin")
+int BPF_PROG(contention_begin, void *lock, unsigned int flags)
+{
+	wait_begin(ctx, (__u64)lock, flags);
+	return 0;
+}
+
+SEC("tp_btf/contention_end")
+int BPF_PROG(contention_end, void *lock, int ret)
+{
+	wait_end((__u64)lock);
+	return 0;
+}
+
+/* Fallbacks for kernels without the lock tracepoints. */
+
+SEC("fentry/queued_spin_lock_slowpath")
+int BPF_PROG(spin_slowpath_enter, struct qspinlock *lock)
+{
+	wait_begin(ctx, (__u64)lock, LCB_F_SPIN);
+	return 0;
+}
+
+SEC("fexit/queued_spin_lock_slowpath")
+int BPF_PROG(spin_slowpath_exit, struct qspinlock *lock)
+{
+	wait_end((__u64)lock);
+	return 0;
+}
+
+SEC("fentry/__mutex_lock_slowpath")
+int BPF_PROG(mutex_slowpath_enter, struct mutex *lock)
+{
+	wait_begin(ctx, (__u64)lock, LCB_F_MUTEX);
+	return 0;
+}
+
+SEC("fexit/__mutex_lock_slowpath")
+int BPF_PROG(mutex_slowpath_exit, struct mutex *lock)
+{
+	wait_end((__u64)lock);
+	return 0;
+}
+
+SEC("fentry/rwsem_down_read_slowpath")
+int BPF_PROG(rwsem_read_enter, struct rw_semaphore *sem)
+{
+	wait_begin(ctx, (__u64)sem, LCB_F_READ);
+	return 0;
+}
+
+SEC("fexit/rwsem_down_read_slowpath")
+int BPF_PROG(rwsem_read_exit, struct rw_semaphore *sem)
+{
+	wait_end((__u64)sem);
+	return 0;
+}
+
+SEC("fentry/rwsem_down_write_slowpath")
+int BPF_PROG(rwsem_write_enter, struct rw_semaphore *sem)
+{
+	wait_begin(ctx, (__u64)sem, LCB_F_WRITE);
+	return 0;
+}
+
+SEC("fexit/rwsem_down_write_slowpath")
+int BPF_PROG(rwsem_write_exit, struct rw_semaphore *sem)
+{
+	wait_end((__u64)sem);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
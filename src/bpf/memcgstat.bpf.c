@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: MIT
+/*
+ * memcgstat: memory.stat for every cgroup in one binary read.
+ *
+ * User space attaches the cgroup iterator to the root of the hierarchy it
+ * wants with BPF_CGROUP_ITER_SELF_ONLY and read()s the link fd once per
+ * scrape.  The program runs once, for that root, and walks its memcg
+ * subtree itself with the open-coded css iterator, filling one struct
+ * memcg_rec per memcg into the preallocated `recs` array instead of 5k
+ * memory.stat files to open and parse:
+ *
+ *	usage/high/max	memory and swap page counters, in pages
+ *	state[]		memcg_vmstats.state, gauges
+ *	events[]	memcg_vmstats.events, monotonic counters
+ *	mem_events[]	memory.events (low, high, max, oom, oom_kill, ...)
+ *
+ * The read returns only a struct memcg_snap saying how many slots of
+ * `recs` were filled; user space then batch-looks them up.  Records never
+ * pass through the seq_file, whose 32 KB buffer would hold a few dozen of
+ * them and which the cgroup iterator cannot resume across reads.  A walk
+ * that finds more than MAX_MEMCGS memcgs stops there and sets truncated.
+ * Scrapes must not overlap, as they share `recs`.
+ *
+ * Slots are in the kernel's internal memcg_vmstats order, which differs
+ * between versions; user space names them from vmlinux BTF and uses the
+ * nr_* fields for the lengths.  The rstat tree is flushed once, at the
+ * root, so the numbers match what memory.stat would have shown.
+ *
+ * With `delta` set, the previous record is kept in cgroup local storage
+ * (`prev`), so it lives exactly as long as the cgroup: events become
+ * increments since the last read and cgroups where nothing changed get no
+ * slot at all.  A cgroup's previous record is only updated
+ * once its slot is filled, so a truncated walk loses no increments.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MEMCG_MAX_STATE		64
+#define MEMCG_MAX_EVENTS	32
+#define MEMCG_MAX_MEM_EVENTS	16
+#define MAX_MEMCGS		8192
+
+const volatile bool delta = false;
+
+extern void cgroup_rstat_flush(struct cgroup *cgrp) __weak __ksym;
+extern void css_rstat_flush(struct cgroup_subsys_state *css) __weak __ksym;
+
+struct memcg_snap {
+	__u32 nr_recs;
+	__u32 truncated;
+};
+
+struct memcg_rec {
+	__u64 cgid;
+	__u64 usage;
+	__u64 high;
+	__u64 max;
+	__u64 swap_usage;
+	__u64 swap_max;
+	__u32 nr_state;
+	__u32 nr_events;
+	__u32 nr_mem_events;
+	__u32 pad;
+	__s64 state[MEMCG_MAX_STATE];
+	__u64 events[MEMCG_MAX_EVENTS];
+	__u64 mem_events[MEMCG_MAX_MEM_EVENTS];
+};
+
+struct memcg_prev {
+	__s64 state[MEMCG_MAX_STATE];
+	__u64 events[MEMCG_MAX_EVENTS];
+	__u64 mem_events[MEMCG_MAX_MEM_EVENTS];
+	__u64 usage;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_MEMCGS);
+	__type(key, __u32);
+	__type(value, struct memcg_rec);
+} recs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CGRP_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct memcg_prev);
+} prev SEC(".maps");
+
+static __always_inline void rstat_flush(struct cgroup *cgrp,
+					struct cgroup_subsys_state *css)
+{
+	if (bpf_ksym_exists(css_rstat_flush))
+		css_rstat_flush(css);
+	else if (bpf_ksym_exists(cgroup_rstat_flush))
+		cgroup_rstat_flush(cgrp);
+}
+
+static __always_inline void memcg_read(struct memcg_rec *rec,
+				       struct mem_cgroup *memcg)
+{
+	struct memcg_vmstats *vmstats = BPF_CORE_READ(memcg, vmstats);
+	__u32 size;
+
+	rec->usage = BPF_CORE_READ(memcg, memory.usage.counter);
+	rec->high = BPF_CORE_READ(memcg, memory.high);
+	rec->max = BPF_CORE_READ(memcg, memory.max);
+	rec->swap_usage = BPF_CORE_READ(memcg, swap.usage.counter);
+	rec->swap_max = BPF_CORE_READ(memcg, swap.max);
+
+	size = bpf_core_field_size(memcg->memory_events);
+	if (size > sizeof(rec->mem_events))
+		size = sizeof(rec->mem_events);
+	rec->nr_mem_events = size / sizeof(__u64);
+	bpf_probe_read_kernel(rec->mem_events, size, &memcg->memory_events);
+
+	size = bpf_core_field_size(vmstats->state);
+	if (size > sizeof(rec->state))
+		size = sizeof(rec->state);
+	rec->nr_state = size / sizeof(__s64);
+	bpf_probe_read_kernel(rec->state, size, &vmstats->state);
+
+	size = bpf_core_field_size(vmstats->events);
+	if (size > sizeof(rec->events))
+		size = sizeof(rec->events);
+	rec->nr_events = size / sizeof(__u64);
+	bpf_probe_read_kernel(rec->events, size, &vmstats->events);
+}
+
+/*
+ * Turns rec into a delta against the stored copy; false if unchanged.
+ * p is left alone until memcg_commit().
+ */
+static __always_inline bool memcg_delta(struct memcg_rec *rec,
+					const struct memcg_prev *p)
+{
+	bool changed = rec->usage != p->usage;
+	int i;
+
+	for (i = 0; i < MEMCG_MAX_STATE; i++)
+		changed |= rec->state[i] != p->state[i];
+	for (i = 0; i < MEMCG_MAX_EVENTS; i++) {
+		rec->events[i] -= p->events[i];
+		changed |= rec->events[i] != 0;
+	}
+	for (i = 0; i < MEMCG_MAX_MEM_EVENTS; i++) {
+		rec->mem_events[i] -= p->mem_events[i];
+		changed |= rec->mem_events[i] != 0;
+	}
+	return changed;
+}
+
+/* Folds an emitted delta record back into the stored copy. */
+static __always_inline void memcg_commit(const struct memcg_rec *rec,
+					 struct memcg_prev *p)
+{
+	int i;
+
+	p->usage = rec->usage;
+	for (i = 0; i < MEMCG_MAX_STATE; i++)
+		p->state[i] = rec->state[i];
+	for (i = 0; i < MEMCG_MAX_EVENTS; i++)
+		p->events[i] += rec->events[i];
+	for (i = 0; i < MEMCG_MAX_MEM_EVENTS; i++)
+		p->mem_events[i] += rec->mem_events[i];
+}
+
+/*
+ * Fills slot @idx for @css; false if the slot can be reused.  Runs under
+ * bpf_rcu_read_lock(), which makes css->cgroup a trusted pointer.
+ */
+static __always_inline bool memcg_fill(__u32 idx,
+				       struct cgroup_subsys_state *css)
+{
+	struct memcg_prev *p = NULL;
+	struct memcg_rec *rec;
+
+	rec = bpf_map_lookup_elem(&recs, &idx);
+	if (!rec)
+		return false;
+
+	__builtin_memset(rec, 0, sizeof(*rec));
+	rec->cgid = BPF_CORE_READ(css, cgroup, kn, id);
+	/* css is the first member of struct mem_cgroup. */
+	memcg_read(rec, (struct mem_cgroup *)css);
+
+	if (!delta)
+		return true;
+
+	p = bpf_cgrp_storage_get(&prev, css->cgroup, NULL,
+				 BPF_LOCAL_STORAGE_GET_F_CREATE);
+	if (!p)
+		return true;
+	if (!memcg_delta(rec, p))
+		return false;
+	memcg_commit(rec, p);
+	return true;
+}
+
+SEC("iter.s/cgroup")
+int dump_memcg(struct bpf_iter__cgroup *ctx)
+{
+	struct cgroup *cgrp = ctx->cgroup;
+	struct cgroup_subsys_state *css, *pos;
+	struct memcg_snap snap = {};
+	struct bpf_iter_css it;
+	int id;
+
+	if (!cgrp)
+		return 0;
+
+	id = bpf_core_enum_value(enum cgroup_subsys_id, memory_cgrp_id);
+	css = BPF_CORE_READ(cgrp, subsys[id]);
+	if (!css)
+		return 0;
+
+	/* Flushing the root flushes its whole subtree; it may sleep. */
+	rstat_flush(cgrp, css);
+
+	bpf_rcu_read_lock();
+	css = cgrp->subsys[id];
+	if (!css) {
+		bpf_rcu_read_unlock();
+		return 0;
+	}
+
+	bpf_iter_css_new(&it, css, BPF_CGROUP_ITER_DESCENDANTS_PRE);
+	while ((pos = bpf_iter_css_next(&it))) {
+		if (snap.nr_recs >= MAX_MEMCGS) {
+			snap.truncated = 1;
+			break;
+		}
+		if (memcg_fill(snap.nr_recs, pos))
+			snap.nr_recs++;
+	}
+	bpf_iter_css_destroy(&it);
+	bpf_rcu_read_unlock();
+
+	bpf_seq_write(ctx->meta->seq, &snap, sizeof(snap));
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
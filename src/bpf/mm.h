@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Folio accessors that stay valid across kernel versions via CO-RE.
+ */
+#ifndef __CX_MM_H
+#define __CX_MM_H
+
+/* Low bits of folio->mapping: 0x1 anon, 0x2 movable_ops, 0x3 KSM. */
+#define PAGE_MAPPING_FLAGS	0x3
+
+/* NULL for anon, KSM and movable_ops folios, which have no owning inode. */
+static __always_inline struct inode *folio_inode(struct folio *folio)
+{
+	struct address_space *mapping = BPF_CORE_READ(folio, mapping);
+
+	if (!mapping || ((__u64)mapping & PAGE_MAPPING_FLAGS))
+		return NULL;
+	return BPF_CORE_READ(mapping, host);
+}
+
+/* cgroup id of the memcg the folio is charged to, 0 if uncharged. */
+static __always_inline __u64 folio_memcg_id(struct folio *folio)
+{
+	__u64 memcg_data = BPF_CORE_READ(folio, memcg_data);
+	struct mem_cgroup *memcg;
+
+	memcg = (void *)(memcg_data & ~((__u64)__NR_MEMCG_DATA_FLAGS - 1));
+	if (!memcg)
+		return 0;
+	return BPF_CORE_READ(memcg, css.cgroup, kn, id);
+}
+
+static __always_inline __u64 folio_nr_pages(struct folio *folio)
+{
+	__u64 flags = BPF_CORE_READ(folio, flags);
+
+	if (!(flags & (1UL << bpf_core_enum_value(enum pageflags, PG_head))))
+		return 1;
+	if (bpf_core_field_exists(folio->_folio_nr_pages))
+		return BPF_CORE_READ(folio, _folio_nr_pages);
+	return 1UL << (BPF_CORE_READ(folio, _flags_1) & 0xff);
+}
+
+/* Before 6.2 rss_stat was a plain array of atomics. */
+struct mm_rss_stat___old {
+	atomic_long_t count[NR_MM_COUNTERS];
+} __attribute__((preserve_access_index));
+
+struct mm_struct___old {
+	struct mm_rss_stat___old rss_stat;
+} __attribute__((preserve_access_index));
+
+/*
+ * One MM_* counter in pages.  The per-CPU deltas are not folded in, the
+ * same approximation get_mm_counter() makes, so small negatives read as 0.
+ */
+static __always_inline __u64 mm_counter(struct mm_struct *mm, int member)
+{
+	struct mm_struct___old *old = (void *)mm;
+	__s64 v;
+
+	if (member < 0 || member >= NR_MM_COUNTERS)
+		return 0;
+	if (bpf_core_type_exists(struct mm_rss_stat___old))
+		v = BPF_CORE_READ(old, rss_stat.count[member].counter);
+	else
+		v = BPF_CORE_READ(mm, rss_stat[member].count);
+	return v > 0 ? v : 0;
+}
+
+static __always_inline __u64 mm_rss_pages(struct mm_struct *mm)
+{
+	return mm_counter(mm, MM_FILEPAGES) + mm_counter(mm, MM_ANONPAGES) +
+	       mm_counter(mm, MM_SHMEMPAGES);
+}
+
+#endif /* __CX_MM_H */
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: MIT
+/*
+ * mmaplock: mmap_lock wait and hold time per process, thread and caller.
+ *
+ *	wait	mmap_lock_start_locking -> mmap_lock_acquire_returned
+ *	hold	mmap_lock_acquire_returned -> mmap_lock_released
+ *
+ * start_locking fires for every blocking acquire, contended or not, so
+ * `blocking` counts those and the wait histogram shows how many actually
+ * waited.  Trylocks acquire without a start_locking event and only
+ * contribute hold time.  mmap_write_downgrade() reports a successful read
+ * acquire with no release in between; the write hold ends there and a read
+ * hold begins.
+ *
+ * Stats are keyed by (mm, tgid, tid, read/write, kernel stack);
+ * per_thread and with_stack drop the thread and stack from the key when
+ * the map would grow too large.  Holds longer than hold_alert_ns are also
+ * streamed through the `long_holds` ring buffer so the offending thread
+ * can be named even after it exits.  Kernel stacks resolve through the
+ * ksym iterator with ksym_all set.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_INFLIGHT	65536
+#define MAX_STACKS	16384
+#define MAX_STAT	32768
+#define PERF_MAX_STACK_DEPTH	127
+
+const volatile __u32 targ_tgid = 0;
+const volatile bool per_thread = true;
+const volatile bool with_stack = true;
+const volatile __u64 hold_alert_ns = 10 * NSEC_PER_MSEC;
+
+/* dup_mmap() holds two mm's locks at once, hence mm in the key. */
+struct hold_key {
+	__u64 mm;
+	__u32 tid;
+	__u32 pad;
+};
+
+struct inflight {
+	__u64 wait_start_ns;
+	__u64 hold_start_ns;
+	__s32 stack_id;
+	__u32 write;
+};
+
+struct mmap_key {
+	__u64 mm;
+	__u32 tgid;
+	__u32 tid;
+	__s32 stack_id;
+	__u32 write;
+};
+
+struct mmap_stat {
+	__u64 acquired;
+	__u64 blocking;
+	__u64 failed;
+	__u64 wait_ns;
+	__u64 wait_max_ns;
+	__u64 hold_ns;
+	__u64 hold_max_ns;
+	char comm[TASK_COMM_LEN];
+	struct hist wait_hist;
+	struct hist hold_hist;
+};
+
+struct long_hold {
+	__u64 mm;
+	__u64 hold_ns;
+	__u32 tgid;
+	__u32 tid;
+	__s32 stack_id;
+	__u32 write;
+	char comm[TASK_COMM_LEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_INFLIGHT);
+	__type(key, struct hold_key);
+	__type(value, struct inflight);
+} inflight SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(max_entries, MAX_STACKS);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct mmap_key);
+	__type(value, struct mmap_stat);
+} stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} long_holds SEC(".maps");
+
+static struct mmap_stat zero_stat;
+
+static __always_inline bool wanted(__u64 pid_tgid)
+{
+	return !targ_tgid || (pid_tgid >> 32) == targ_tgid;
+}
+
+static __always_inline struct mmap_stat *
+stat_get(__u64 mm, __u64 pid_tgid, __s32 stack_id, bool write)
+{
+	struct mmap_key key = {
+		.mm = mm,
+		.tgid = pid_tgid >> 32,
+		.tid = per_thread ? (__u32)pid_tgid : 0,
+		.stack_id = with_stack ? stack_id : -1,
+		.write = write,
+	};
+	struct mmap_stat *st;
+
+	st = bpf_map_lookup_elem(&stats, &key);
+	if (st)
+		return st;
+
+	st = map_lookup_or_try_init(&stats, &key, &zero_stat);
+	if (st)
+		bpf_get_current_comm(st->comm, sizeof(st->comm));
+	return st;
+}
+
+static __always_inline void hold_end(__u64 mm, __u64 pid_tgid, __u64 hold,
+				    __s32 stack_id, __u32 write)
+{
+	struct mmap_stat *st;
+	struct long_hold *e;
+
+	st = stat_get(mm, pid_tgid, stack_id, write);
+	if (st) {
+		__sync_fetch_and_add(&st->hold_ns, hold);
+		max_store(&st->hold_max_ns, hold);
+		hist_add(&st->hold_hist, hold / NSEC_PER_USEC);
+	}
+
+	if (hold < hold_alert_ns)
+		return;
+
+	e = bpf_ringbuf_reserve(&long_holds, sizeof(*e), 0);
+	if (!e)
+		return;
+
+	e->mm = mm;
+	e->hold_ns = hold;
+	e->tgid = pid_tgid >> 32;
+	e->tid = (__u32)pid_tgid;
+	e->stack_id = stack_id;
+	e->write = write;
+	bpf_get_current_comm(e->comm, sizeof(e->comm));
+	bpf_ringbuf_submit(e, 0);
+}
+
+SEC("tracepoint/mmap_lock/mmap_lock_start_locking")
+int handle_start_locking(struct trace_event_raw_mmap_lock *ctx)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct hold_key key = {
+		.mm = (__u64)ctx->mm,
+		.tid = (__u32)pid_tgid,
+	};
+	struct inflight f = {
+		.write = ctx->write,
+		.stack_id = -1,
+	};
+
+	if (!wanted(pid_tgid))
+		return 0;
+
+	f.wait_start_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&inflight, &key, &f, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/mmap_lock/mmap_lock_acquire_returned")
+int handle_acquire_returned(struct trace_event_raw_mmap_lock_acquire_returned *ctx)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct hold_key key = {
+		.mm = (__u64)ctx->mm,
+		.tid = (__u32)pid_tgid,
+	};
+	struct inflight f = {}, *fp;
+	__u64 now, wait = 0;
+	struct mmap_stat *st;
+
+	if (!wanted(pid_tgid))
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	fp = bpf_map_lookup_elem(&inflight, &key);
+	if (fp && fp->wait_start_ns)
+		wait = now - fp->wait_start_ns;
+
+	/* A read acquire over our own write hold is a downgrade. */
+	if (fp && fp->hold_start_ns && fp->write && !ctx->write && ctx->success)
+		hold_end(key.mm, pid_tgid, now - fp->hold_start_ns,
+			 fp->stack_id, fp->write);
+
+	f.write = ctx->write;
+	f.stack_id = with_stack ? bpf_get_stackid(ctx, &stacks, 0) : -1;
+
+	st = stat_get(key.mm, pid_tgid, f.stack_id, f.write);
+	if (st) {
+		if (ctx->success)
+			__sync_fetch_and_add(&st->acquired, 1);
+		else
+			__sync_fetch_and_add(&st->failed, 1);
+		if (wait) {
+			__sync_fetch_and_add(&st->blocking, 1);
+			__sync_fetch_and_add(&st->wait_ns, wait);
+			max_store(&st->wait_max_ns, wait);
+			hist_add(&st->wait_hist, wait / NSEC_PER_USEC);
+		}
+	}
+
+	if (!ctx->success) {
+		bpf_map_delete_elem(&inflight, &key);
+		return 0;
+	}
+
+	f.hold_start_ns = now;
+	bpf_map_update_elem(&inflight, &key, &f, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/mmap_lock/mmap_lock_released")
+int handle_released(struct trace_event_raw_mmap_lock *ctx)
+{
+	__u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct hold_key key = {
+		.mm = (__u64)ctx->mm,
+		.tid = (__u32)pid_tgid,
+	};
+	struct inflight *fp;
+	__s32 stack_id;
+	__u64 hold;
+	__u32 write;
+
+	fp = bpf_map_lookup_elem(&inflight, &key);
+	if (!fp || !fp->hold_start_ns)
+		return 0;
+
+	hold = bpf_ktime_get_ns() - fp->hold_start_ns;
+	stack_id = fp->stack_id;
+	write = fp->write;
+	bpf_map_delete_elem(&inflight, &key);
+
+	hold_end(key.mm, pid_tgid, hold, stack_id, write);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
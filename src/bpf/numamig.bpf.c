@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: MIT
+/*
+ * numamig: page migration volume and NUMA balancing cost per process.
+ *
+ * Migrations run in the context of whoever needs them (the faulting task
+ * for NUMA hinting faults, kcompactd, a syscall), so they are charged to
+ * the current process, split by migrate reason:
+ *
+ *	calls/ns		mm_migrate_pages_start -> mm_migrate_pages
+ *	succeeded/failed	pages, and the THP subset of each
+ *	thp_split		THPs that had to be split to migrate
+ *
+ * The NUMA balancing side is per process only:
+ *
+ *	scan_ns/scans		task_numa_work(), the periodic PTE scan
+ *	moves/swaps/stuck	sched_move_numa, sched_swap_numa and
+ *				sched_stick_numa
+ *
+ * MR_NUMA_MISPLACED time plus scan_ns is what balancing costs a process;
+ * comparing it with the locality gained is the disable/keep decision.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_TASKS	16384
+#define MAX_PROCS	16384
+#define MAX_REASONS	16
+
+struct mig_start {
+	__u64 ts;
+	__u32 reason;
+	__u32 pad;
+};
+
+struct mig_key {
+	__u32 tgid;
+	__u32 reason;
+};
+
+struct mig_stat {
+	__u64 calls;
+	__u64 ns;
+	__u64 max_ns;
+	__u64 succeeded;
+	__u64 failed;
+	__u64 thp_succeeded;
+	__u64 thp_failed;
+	__u64 thp_split;
+	char comm[TASK_COMM_LEN];
+};
+
+struct balance_stat {
+	__u64 cgid;
+	__u64 scans;
+	__u64 scan_ns;
+	__u64 moves;
+	__u64 cross_node;
+	__u64 swaps;
+	__u64 stuck;
+	char comm[TASK_COMM_LEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct mig_start);
+} migrating SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} scanning SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROCS);
+	__type(key, struct mig_key);
+	__type(value, struct mig_stat);
+} migrations SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROCS);
+	__type(key, __u32);
+	__type(value, struct balance_stat);
+} balance SEC(".maps");
+
+static struct mig_stat zero_mig;
+static struct balance_stat zero_balance;
+
+/* Takes cgroup and comm from current: call only on the task's behalf. */
+static __always_inline struct balance_stat *balance_get(__u32 tgid)
+{
+	struct balance_stat *bs;
+
+	bs = bpf_map_lookup_elem(&balance, &tgid);
+	if (bs)
+		return bs;
+
+	bs = map_lookup_or_try_init(&balance, &tgid, &zero_balance);
+	if (bs) {
+		bs->cgid = bpf_get_current_cgroup_id();
+		bpf_get_current_comm(bs->comm, sizeof(bs->comm));
+	}
+	return bs;
+}
+
+SEC("tracepoint/migrate/mm_migrate_pages_start")
+int handle_migrate_start(struct trace_event_raw_mm_migrate_pages_start *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct mig_start s = {
+		.ts = bpf_ktime_get_ns(),
+		.reason = ctx->reason,
+	};
+
+	bpf_map_update_elem(&migrating, &tid, &s, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/migrate/mm_migrate_pages")
+int handle_migrate_end(struct trace_event_raw_mm_migrate_pages *ctx)
+{
+	__u64 id = bpf_get_current_pid_tgid();
+	struct mig_key key = { .tgid = id >> 32 };
+	__u32 tid = (__u32)id;
+	struct mig_start *s;
+	struct mig_stat *st;
+	__u64 delta = 0;
+
+	s = bpf_map_lookup_elem(&migrating, &tid);
+	if (s) {
+		delta = bpf_ktime_get_ns() - s->ts;
+		bpf_map_delete_elem(&migrating, &tid);
+	}
+
+	key.reason = ctx->reason;
+	if (key.reason >= MAX_REASONS)
+		key.reason = MAX_REASONS - 1;
+
+	st = bpf_map_lookup_elem(&migrations, &key);
+	if (!st) {
+		st = map_lookup_or_try_init(&migrations, &key, &zero_mig);
+		if (!st)
+			return 0;
+		bpf_get_current_comm(st->comm, sizeof(st->comm));
+	}
+
+	__sync_fetch_and_add(&st->calls, 1);
+	__sync_fetch_and_add(&st->ns, delta);
+	max_store(&st->max_ns, delta);
+	__sync_fetch_and_add(&st->succeeded, ctx->succeeded);
+	__sync_fetch_and_add(&st->failed, ctx->failed);
+	__sync_fetch_and_add(&st->thp_succeeded, ctx->thp_succeeded);
+	__sync_fetch_and_add(&st->thp_failed, ctx->thp_failed);
+	__sync_fetch_and_add(&st->thp_split, ctx->thp_split);
+	return 0;
+}
+
+SEC("fentry/task_numa_work")
+int BPF_PROG(numa_work_enter)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 now = bpf_ktime_get_ns();
+
+	bpf_map_update_elem(&scanning, &tid, &now, BPF_ANY);
+	return 0;
+}
+
+SEC("fexit/task_numa_work")
+int BPF_PROG(numa_work_exit)
+{
+	__u64 id = bpf_get_current_pid_tgid();
+	__u32 tid = (__u32)id;
+	struct balance_stat *bs;
+	__u64 *tsp, delta;
+
+	tsp = bpf_map_lookup_elem(&scanning, &tid);
+	if (!tsp)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - *tsp;
+	bpf_map_delete_elem(&scanning, &tid);
+
+	bs = balance_get(id >> 32);
+	if (bs) {
+		__sync_fetch_and_add(&bs->scans, 1);
+		__sync_fetch_and_add(&bs->scan_ns, delta);
+	}
+	return 0;
+}
+
+/* Balancing moves are decided by the task itself in task_numa_migrate(). */
+SEC("tracepoint/sched/sched_move_numa")
+int handle_move_numa(struct trace_event_raw_sched_move_numa *ctx)
+{
+	struct balance_stat *bs = balance_get(ctx->tgid);
+
+	if (!bs)
+		return 0;
+
+	__sync_fetch_and_add(&bs->moves, 1);
+	if (ctx->src_nid != ctx->dst_nid)
+		__sync_fetch_and_add(&bs->cross_node, 1);
+	return 0;
+}
+
+SEC("tracepoint/sched/sched_swap_numa")
+int handle_swap_numa(struct trace_event_raw_sched_numa_pair_template *ctx)
+{
+	struct balance_stat *bs = balance_get(ctx->src_tgid);
+
+	if (bs)
+		__sync_fetch_and_add(&bs->swaps, 1);
+	return 0;
+}
+
+SEC("tracepoint/sched/sched_stick_numa")
+int handle_stick_numa(struct trace_event_raw_sched_numa_pair_template *ctx)
+{
+	struct balance_stat *bs = balance_get(ctx->src_tgid);
+
+	if (bs)
+		__sync_fetch_and_add(&bs->stuck, 1);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: MIT
+/*
+ * oomsnap: one self-contained forensic record per OOM kill.
+ *
+ * out_of_memory() runs under oom_lock, so one record is open at a time:
+ *
+ *	fentry out_of_memory	trigger task, gfp/order, OOM memcg, kernel
+ *				stack of the failing allocation, and the
+ *				OOM_TOP_N largest processes in scope
+ *	mark_victim		victim pid, rss breakdown, oom_score_adj
+ *	fexit out_of_memory	chosen task, its points and cgroup
+ *	finish_task_reaping	when the oom_reaper got the memory back
+ *
+ * The top list walks thread group leaders with the open-coded task
+ * iterator and is limited to the OOM memcg's subtree (cgroup v2) for memcg
+ * OOMs.  Records land in `records`, an array used as a ring that user space
+ * pins in bpffs, so they outlive both dmesg and the reader; `seq` orders
+ * them and done_ns stays 0 while one is being filled.  Nothing on this path
+ * allocates: every map is a preallocated array.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "mm.h"
+
+#define MAX_RECORDS	64
+#define OOM_TOP_N	16
+#define OOM_STACK_DEPTH	32
+
+/* Bounds the task walk on hosts with very many processes. */
+const volatile __u32 scan_max = 65536;
+
+struct oom_task {
+	__u64 cgid;
+	__u64 rss_pages;
+	__u32 pid;
+	__s16 oom_score_adj;
+	__u16 pad;
+	char comm[TASK_COMM_LEN];
+};
+
+struct oom_record {
+	__u64 seq;
+	__u64 ts_ns;
+	__u64 done_ns;
+	__u64 reaped_ns;
+
+	__u32 pid;
+	__u32 order;
+	__u32 gfp_mask;
+	__u32 constraint;
+	__u64 cgid;
+	__u64 memcg_cgid;
+	__u64 totalpages;
+	char comm[TASK_COMM_LEN];
+
+	__u32 victim_pid;
+	__s16 victim_score_adj;
+	__u16 killed;
+	__u64 victim_cgid;
+	__s64 chosen_points;
+	__u64 total_vm;
+	__u64 anon_rss;
+	__u64 file_rss;
+	__u64 shmem_rss;
+	__u64 pgtables;
+	__u32 uid;
+	char victim_comm[TASK_COMM_LEN];
+
+	__u32 nr_scanned;
+	__u32 nr_top;
+	__s32 stack_len;
+	__u64 stack[OOM_STACK_DEPTH];
+	struct oom_task top[OOM_TOP_N];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_RECORDS);
+	__type(key, __u32);
+	__type(value, struct oom_record);
+} records SEC(".maps");
+
+__u64 oom_seq = 0;
+static bool cur_open;
+static __u32 cur_idx;
+static __u32 last_idx;
+
+static __always_inline struct oom_record *record_get(__u32 idx)
+{
+	return bpf_map_lookup_elem(&records, &idx);
+}
+
+static __always_inline bool in_scope(struct task_struct *t,
+				     struct cgroup *scope, int level)
+{
+	struct cgroup *cgrp;
+
+	if (!scope)
+		return true;
+
+	cgrp = BPF_CORE_READ(t, cgroups, dfl_cgrp);
+	if (!cgrp || BPF_CORE_READ(cgrp, level) < level)
+		return false;
+	return BPF_CORE_READ(cgrp, ancestors[level]) == scope;
+}
+
+static __always_inline void top_insert(struct oom_record *rec,
+				       struct task_struct *t, __u64 rss)
+{
+	struct oom_task *slot;
+	__u32 i, min = 0;
+
+	for (i = 1; i < OOM_TOP_N; i++) {
+		if (rec->top[i].rss_pages < rec->top[min].rss_pages)
+			min = i;
+	}
+	if (min >= OOM_TOP_N || rss <= rec->top[min].rss_pages)
+		return;
+
+	slot = &rec->top[min];
+	slot->pid = BPF_CORE_READ(t, tgid);
+	slot->rss_pages = rss;
+	slot->cgid = BPF_CORE_READ(t, cgroups, dfl_cgrp, kn, id);
+	slot->oom_score_adj = BPF_CORE_READ(t, signal, oom_score_adj);
+	BPF_CORE_READ_STR_INTO(&slot->comm, t, comm);
+	if (rec->nr_top < OOM_TOP_N)
+		rec->nr_top++;
+}
+
+static __always_inline void top_scan(struct oom_record *rec,
+				     struct cgroup *scope)
+{
+	struct bpf_iter_task it;
+	struct task_struct *t;
+	struct mm_struct *mm;
+	int level = 0;
+
+	if (scope)
+		level = BPF_CORE_READ(scope, level);
+
+	bpf_iter_task_new(&it, NULL, BPF_TASK_ITER_ALL_PROCS);
+	while ((t = bpf_iter_task_next(&it))) {
+		if (rec->nr_scanned++ >= scan_max)
+			break;
+		mm = BPF_CORE_READ(t, mm);
+		if (!mm || !in_scope(t, scope, level))
+			continue;
+		top_insert(rec, t, mm_rss_pages(mm));
+	}
+	bpf_iter_task_destroy(&it);
+}
+
+SEC("fentry/out_of_memory")
+int BPF_PROG(oom_enter, struct oom_control *oc)
+{
+	struct cgroup *scope = NULL;
+	struct mem_cgroup *memcg;
+	struct oom_record *rec;
+	__u64 seq;
+	__u32 idx;
+
+	seq = __sync_fetch_and_add(&oom_seq, 1);
+	idx = seq % MAX_RECORDS;
+	rec = record_get(idx);
+	if (!rec)
+		return 0;
+
+	__builtin_memset(rec, 0, sizeof(*rec));
+	rec->seq = seq;
+	rec->ts_ns = bpf_ktime_get_ns();
+	rec->pid = bpf_get_current_pid_tgid() >> 32;
+	rec->cgid = bpf_get_current_cgroup_id();
+	bpf_get_current_comm(rec->comm, sizeof(rec->comm));
+	rec->order = BPF_CORE_READ(oc, order);
+	rec->gfp_mask = BPF_CORE_READ(oc, gfp_mask);
+	rec->totalpages = BPF_CORE_READ(oc, totalpages);
+
+	memcg = BPF_CORE_READ(oc, memcg);
+	if (memcg) {
+		scope = BPF_CORE_READ(memcg, css.cgroup);
+		rec->memcg_cgid = BPF_CORE_READ(scope, kn, id);
+	}
+
+	rec->stack_len = bpf_get_stack(ctx, rec->stack, sizeof(rec->stack), 0);
+	top_scan(rec, scope);
+
+	cur_idx = idx;
+	last_idx = idx;
+	cur_open = true;
+	return 0;
+}
+
+SEC("tracepoint/oom/mark_victim")
+int handle_mark_victim(struct trace_event_raw_mark_victim *ctx)
+{
+	struct oom_record *rec;
+	__u32 off;
+
+	if (!cur_open)
+		return 0;
+	rec = record_get(cur_idx);
+	if (!rec)
+		return 0;
+
+	rec->victim_pid = ctx->pid;
+	if (!bpf_core_field_exists(ctx->total_vm))
+		return 0;
+
+	rec->total_vm = ctx->total_vm;
+	rec->anon_rss = ctx->anon_rss;
+	rec->file_rss = ctx->file_rss;
+	rec->shmem_rss = ctx->shmem_rss;
+	rec->pgtables = ctx->pgtables;
+	rec->uid = ctx->uid;
+	rec->victim_score_adj = ctx->oom_score_adj;
+	off = ctx->__data_loc_comm & 0xffff;
+	bpf_probe_read_kernel_str(rec->victim_comm, sizeof(rec->victim_comm),
+				  (void *)ctx + off);
+	return 0;
+}
+
+SEC("fexit/out_of_memory")
+int BPF_PROG(oom_exit, struct oom_control *oc, bool ret)
+{
+	struct task_struct *chosen;
+	struct oom_record *rec;
+
+	if (!cur_open)
+		return 0;
+	cur_open = false;
+	rec = record_get(cur_idx);
+	if (!rec)
+		return 0;
+
+	rec->killed = ret;
+	rec->constraint = BPF_CORE_READ(oc, constraint);
+	rec->chosen_points = BPF_CORE_READ(oc, chosen_points);
+
+	/* -1 means a victim was already dying and nothing was picked. */
+	chosen = BPF_CORE_READ(oc, chosen);
+	if (chosen && (long)chosen != -1) {
+		rec->victim_cgid = BPF_CORE_READ(chosen, cgroups, dfl_cgrp,
+						 kn, id);
+		if (!rec->victim_pid) {
+			rec->victim_pid = BPF_CORE_READ(chosen, tgid);
+			rec->victim_score_adj = BPF_CORE_READ(chosen, signal,
+							      oom_score_adj);
+			BPF_CORE_READ_STR_INTO(&rec->victim_comm, chosen,
+					       comm);
+		}
+	}
+	rec->done_ns = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("tracepoint/oom/finish_task_reaping")
+int handle_finish_reaping(struct trace_event_raw_finish_task_reaping *ctx)
+{
+	struct oom_record *rec = record_get(last_idx);
+
+	if (rec && rec->victim_pid == (__u32)ctx->pid && !rec->reaped_ns)
+		rec->reaped_ns = bpf_ktime_get_ns();
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: MIT
+/*
+ * pagealloc: page allocator hot path, per CPU, order and migratetype.
+ *
+ * Every event only bumps per-CPU counters, so the tool stays cheap at
+ * millions of allocations per second; user space polls and turns the
+ * counters into rates.
+ *
+ *	EV_ALLOC	mm_page_alloc that returned a page
+ *	EV_ALLOC_FAIL	mm_page_alloc that failed (pfn -1), nothing else
+ *	EV_ZONE_LOCKED	mm_page_alloc_zone_locked, taken under zone->lock
+ *	EV_PCP_REFILL	the same with percpu_refill: a pcp list ran empty
+ *	EV_PCP_DRAIN	mm_page_pcpu_drain, one per page sent back to buddy
+ *	EV_FREE_BATCHED	mm_page_free_batched
+ *	EV_FALLBACK	mm_page_alloc_extfrag
+ *
+ * `orders` splits allocations and drains by (order, migratetype) and
+ * `fallbacks` counts (wanted, fallback) migratetype pairs.  A high
+ * ZONE_LOCKED/ALLOC ratio or drain bursts on one CPU are the latency
+ * signal; lockcon says how long zone->lock was actually waited for.  One
+ * allocation in `sample_every` takes a kernel stack for `callers`; stacks
+ * resolve through the ksym iterator with ksym_all set.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_ORDER_NR	11
+#define MAX_MT		8
+#define MAX_CALLERS	16384
+#define MAX_STACKS	16384
+#define PERF_MAX_STACK_DEPTH	127
+
+enum page_event {
+	EV_ALLOC,
+	EV_ALLOC_FAIL,
+	EV_ZONE_LOCKED,
+	EV_PCP_REFILL,
+	EV_PCP_DRAIN,
+	EV_FREE_BATCHED,
+	EV_FALLBACK,
+	EV_MAX,
+};
+
+const volatile __u32 sample_every = 1024;
+const volatile __u32 stack_skip = 1;
+
+struct order_stat {
+	__u64 allocs;
+	__u64 drains;
+};
+
+struct caller_key {
+	__s32 stack_id;
+	__u16 order;
+	__u16 migratetype;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, EV_MAX);
+	__type(key, __u32);
+	__type(value, __u64);
+} events SEC(".maps");
+
+/* Index: order * MAX_MT + migratetype. */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, MAX_ORDER_NR * MAX_MT);
+	__type(key, __u32);
+	__type(value, struct order_stat);
+} orders SEC(".maps");
+
+/* Index: wanted * MAX_MT + fallback. */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, MAX_MT * MAX_MT);
+	__type(key, __u32);
+	__type(value, __u64);
+} fallbacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(max_entries, MAX_STACKS);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_CALLERS);
+	__type(key, struct caller_key);
+	__type(value, __u64);
+} callers SEC(".maps");
+
+static __u64 zero_count;
+
+/* Per-CPU slots, and programs do not nest on their own CPU. */
+static __always_inline void event_inc(__u32 ev)
+{
+	__u64 *v = bpf_map_lookup_elem(&events, &ev);
+
+	if (v)
+		(*v)++;
+}
+
+static __always_inline struct order_stat *order_get(__u32 order, __u32 mt)
+{
+	__u32 idx;
+
+	if (order >= MAX_ORDER_NR)
+		order = MAX_ORDER_NR - 1;
+	if (mt >= MAX_MT)
+		mt = MAX_MT - 1;
+	idx = order * MAX_MT + mt;
+	return bpf_map_lookup_elem(&orders, &idx);
+}
+
+SEC("tracepoint/kmem/mm_page_alloc")
+int handle_page_alloc(struct trace_event_raw_mm_page_alloc *ctx)
+{
+	struct caller_key key = {};
+	struct order_stat *os;
+	__u64 *count;
+
+	/* The tracepoint fires on failure too, with pfn set to -1UL. */
+	if (ctx->pfn == -1UL) {
+		event_inc(EV_ALLOC_FAIL);
+		return 0;
+	}
+
+	event_inc(EV_ALLOC);
+	os = order_get(ctx->order, ctx->migratetype);
+	if (os)
+		os->allocs++;
+
+	if (sample_every > 1 && bpf_get_prandom_u32() % sample_every)
+		return 0;
+
+	key.stack_id = bpf_get_stackid(ctx, &stacks,
+				       stack_skip & BPF_F_SKIP_FIELD_MASK);
+	key.order = ctx->order;
+	key.migratetype = ctx->migratetype;
+	count = map_lookup_or_try_init(&callers, &key, &zero_count);
+	if (count)
+		__sync_fetch_and_add(count, 1);
+	return 0;
+}
+
+SEC("tracepoint/kmem/mm_page_alloc_zone_locked")
+int handle_zone_locked(struct trace_event_raw_mm_page *ctx)
+{
+	event_inc(EV_ZONE_LOCKED);
+	if (ctx->percpu_refill)
+		event_inc(EV_PCP_REFILL);
+	return 0;
+}
+
+SEC("tracepoint/kmem/mm_page_pcpu_drain")
+int handle_pcpu_drain(struct trace_event_raw_mm_page_pcpu_drain *ctx)
+{
+	struct order_stat *os;
+
+	event_inc(EV_PCP_DRAIN);
+	os = order_get(ctx->order, ctx->migratetype);
+	if (os)
+		os->drains++;
+	return 0;
+}
+
+SEC("tracepoint/kmem/mm_page_free_batched")
+int handle_free_batched(struct trace_event_raw_mm_page_free_batched *ctx)
+{
+	event_inc(EV_FREE_BATCHED);
+	return 0;
+}
+
+SEC("tracepoint/kmem/mm_page_alloc_extfrag")
+int handle_extfrag(struct trace_event_raw_mm_page_alloc_extfrag *ctx)
+{
+	__u32 want = ctx->alloc_migratetype;
+	__u32 got = ctx->fallback_migratetype;
+	__u64 *v;
+	__u32 idx;
+
+	event_inc(EV_FALLBACK);
+	if (want >= MAX_MT || got >= MAX_MT)
+		return 0;
+
+	idx = want * MAX_MT + got;
+	v = bpf_map_lookup_elem(&fallbacks, &idx);
+	if (v)
+		(*v)++;
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
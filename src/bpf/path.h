@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Inode identity and dentry-walk path capture.
+ *
+ * BPF cannot call d_path() from most hooks, so paths are captured as up
+ * to PATH_DEPTH dentry names, leaf first, by following d_parent.  The walk
+ * stops at the root of the inode's filesystem: user space prefixes the
+ * mount point of `dev` to get an absolute path.  Capture once per inode
+ * and cache it; the walk is far too expensive for every event.
+ */
+#ifndef __CX_PATH_H
+#define __CX_PATH_H
+
+#define PATH_DEPTH	8
+#define PATH_NAME_LEN	32
+
+struct inode_key {
+	__u32 dev;
+	__u32 pad;
+	__u64 ino;
+};
+
+struct file_path {
+	__u32 depth;
+	/* Set when the walk ran out of PATH_DEPTH before reaching the root. */
+	__u32 truncated;
+	char comp[PATH_DEPTH][PATH_NAME_LEN];
+};
+
+static __always_inline void inode_key_of(struct inode_key *key,
+					 struct inode *inode)
+{
+	key->dev = BPF_CORE_READ(inode, i_sb, s_dev);
+	key->pad = 0;
+	key->ino = BPF_CORE_READ(inode, i_ino);
+}
+
+static __always_inline void path_from_dentry(struct file_path *p,
+					     struct dentry *d)
+{
+	struct dentry *parent;
+	int i;
+
+	p->depth = 0;
+	p->truncated = 0;
+	for (i = 0; i < PATH_DEPTH; i++) {
+		bpf_probe_read_kernel_str(p->comp[i], PATH_NAME_LEN,
+					  BPF_CORE_READ(d, d_name.name));
+		p->depth++;
+
+		parent = BPF_CORE_READ(d, d_parent);
+		if (!parent || parent == d)
+			return;
+		d = parent;
+	}
+	p->truncated = 1;
+}
+
+static struct file_path path_zero;
+
+/* Capture @file's path into the inode_key -> file_path map @paths once. */
+static __always_inline void path_note(void *paths, struct file *file)
+{
+	struct file_path *p;
+	struct inode_key key;
+
+	inode_key_of(&key, BPF_CORE_READ(file, f_inode));
+	if (bpf_map_lookup_elem(paths, &key))
+		return;
+
+	p = map_lookup_or_try_init(paths, &key, &path_zero);
+	if (p)
+		path_from_dentry(p, BPF_CORE_READ(file, f_path.dentry));
+}
+
+#endif /* __CX_PATH_H */
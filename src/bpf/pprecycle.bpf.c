@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: MIT
+/*
+ * pprecycle: page_pool recycling efficiency per pool, queue and node.
+ *
+ * A page_pool only touches the page allocator when recycling failed, and
+ * that is exactly what its tracepoints report:
+ *
+ *	holds		page_pool_state_hold, a fresh page entered the pool
+ *	releases	page_pool_state_release, a page went back to buddy
+ *	remote		holds on a CPU outside the pool's NUMA node
+ *
+ * The pool's own alloc_stats (CONFIG_PAGE_POOL_STATS) are copied on each
+ * of its events, and, since a pool that recycles well has none, also from
+ * napi_poll on the pool's NAPI instance at most every alloc_refresh_ns.
+ * User space gets recycled = fast + refill against fresh = holds without
+ * reading per-CPU recycle_stats.  Every pool carries its id, netdev
+ * ifindex, rx queue, napi id and node, which is all that is needed to roll
+ * pools up per NIC queue; `nodes` keeps the per-node sums directly.
+ *
+ * page_pool_update_nid moves a pool, page_pool_release records the pages
+ * still in flight while a pool is being torn down.  Once that reaches zero
+ * the pool is gone: its final record is sent on `retired` and the entry is
+ * dropped, so a new pool at the same address starts from scratch.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_POOLS	4096
+#define MAX_NODES	64
+
+const volatile __u64 alloc_refresh_ns = 100 * NSEC_PER_MSEC;
+
+struct pool_stat {
+	__u32 id;
+	__u32 ifindex;
+	__u32 queue;
+	__u32 napi_id;
+	__s32 nid;
+	__u32 order;
+	__u64 holds;
+	__u64 releases;
+	__u64 remote;
+	__u64 nid_changes;
+	__u64 release_calls;
+	__s64 inflight;
+	__u64 napi;
+	__u64 alloc_ns;
+	struct page_pool_alloc_stats alloc;
+};
+
+struct node_stat {
+	__u64 holds;
+	__u64 releases;
+	__u64 remote;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_POOLS);
+	__type(key, __u64);
+	__type(value, struct pool_stat);
+} pools SEC(".maps");
+
+/* NAPI instance -> the pool it allocates from. */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_POOLS);
+	__type(key, __u64);
+	__type(value, __u64);
+} napis SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 64 * 1024);
+} retired SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_NODES);
+	__type(key, __u32);
+	__type(value, struct node_stat);
+} nodes SEC(".maps");
+
+static struct pool_stat zero_pool;
+
+static __always_inline struct pool_stat *pool_get(const struct page_pool *pool)
+{
+	__u64 key = (__u64)pool;
+	struct pool_stat *ps;
+
+	ps = bpf_map_lookup_elem(&pools, &key);
+	if (ps)
+		return ps;
+
+	ps = map_lookup_or_try_init(&pools, &key, &zero_pool);
+	if (!ps)
+		return NULL;
+
+	ps->nid = BPF_CORE_READ(pool, p.nid);
+	ps->order = BPF_CORE_READ(pool, p.order);
+	/*
+	 * These members came in over several releases, not together with
+	 * their parent struct, so each is probed on its own; the ones a
+	 * kernel lacks stay 0 from zero_pool.
+	 */
+	if (bpf_core_field_exists(pool->p.napi))
+		ps->napi = (__u64)BPF_CORE_READ(pool, p.napi);
+	if (ps->napi)
+		bpf_map_update_elem(&napis, &ps->napi, &key, BPF_ANY);
+	if (bpf_core_field_exists(pool->user.id))
+		ps->id = BPF_CORE_READ(pool, user.id);
+	if (bpf_core_field_exists(pool->user.napi_id))
+		ps->napi_id = BPF_CORE_READ(pool, user.napi_id);
+	if (bpf_core_field_exists(pool->slow.netdev))
+		ps->ifindex = BPF_CORE_READ(pool, slow.netdev, ifindex);
+	if (bpf_core_field_exists(pool->slow.queue_idx))
+		ps->queue = BPF_CORE_READ(pool, slow.queue_idx);
+	return ps;
+}
+
+static __always_inline void alloc_sample(const struct page_pool *pool,
+					 struct pool_stat *ps)
+{
+	if (!bpf_core_field_exists(pool->alloc_stats))
+		return;
+
+	bpf_probe_read_kernel(&ps->alloc, sizeof(ps->alloc), &pool->alloc_stats);
+	ps->alloc_ns = bpf_ktime_get_ns();
+}
+
+static __always_inline struct node_stat *node_get(__s32 nid)
+{
+	__u32 idx = nid;
+
+	if (nid < 0)
+		return NULL;
+	return bpf_map_lookup_elem(&nodes, &idx);
+}
+
+SEC("tracepoint/page_pool/page_pool_state_hold")
+int handle_hold(struct trace_event_raw_page_pool_state_hold *ctx)
+{
+	const struct page_pool *pool = ctx->pool;
+	struct pool_stat *ps = pool_get(pool);
+	struct node_stat *ns;
+	bool remote;
+
+	if (!ps)
+		return 0;
+
+	remote = ps->nid >= 0 && ps->nid != bpf_get_numa_node_id();
+	__sync_fetch_and_add(&ps->holds, 1);
+	if (remote)
+		__sync_fetch_and_add(&ps->remote, 1);
+	alloc_sample(pool, ps);
+
+	ns = node_get(ps->nid);
+	if (ns) {
+		__sync_fetch_and_add(&ns->holds, 1);
+		if (remote)
+			__sync_fetch_and_add(&ns->remote, 1);
+	}
+	return 0;
+}
+
+SEC("tracepoint/page_pool/page_pool_state_release")
+int handle_release(struct trace_event_raw_page_pool_state_release *ctx)
+{
+	struct pool_stat *ps = pool_get(ctx->pool);
+	struct node_stat *ns;
+
+	if (!ps)
+		return 0;
+
+	__sync_fetch_and_add(&ps->releases, 1);
+	alloc_sample(ctx->pool, ps);
+	ns = node_get(ps->nid);
+	if (ns)
+		__sync_fetch_and_add(&ns->releases, 1);
+	return 0;
+}
+
+SEC("tracepoint/page_pool/page_pool_update_nid")
+int handle_update_nid(struct trace_event_raw_page_pool_update_nid *ctx)
+{
+	struct pool_stat *ps = pool_get(ctx->pool);
+
+	if (!ps)
+		return 0;
+
+	ps->nid = ctx->new_nid;
+	__sync_fetch_and_add(&ps->nid_changes, 1);
+	return 0;
+}
+
+SEC("tracepoint/page_pool/page_pool_release")
+int handle_pool_release(struct trace_event_raw_page_pool_release *ctx)
+{
+	__u64 key = (__u64)ctx->pool;
+	struct pool_stat *ps, *e;
+
+	/* A pool we never saw has nothing to retire. */
+	ps = ctx->inflight ? pool_get(ctx->pool)
+			   : bpf_map_lookup_elem(&pools, &key);
+	if (!ps)
+		return 0;
+
+	ps->inflight = ctx->inflight;
+	__sync_fetch_and_add(&ps->release_calls, 1);
+	alloc_sample(ctx->pool, ps);
+	if (ctx->inflight)
+		return 0;
+
+	e = bpf_ringbuf_reserve(&retired, sizeof(*e), 0);
+	if (e) {
+		__builtin_memcpy(e, ps, sizeof(*e));
+		bpf_ringbuf_submit(e, 0);
+	}
+	if (ps->napi)
+		bpf_map_delete_elem(&napis, &ps->napi);
+	bpf_map_delete_elem(&pools, &key);
+	return 0;
+}
+
+SEC("tp_btf/napi_poll")
+int BPF_PROG(napi_poll, struct napi_struct *napi, int work, int budget)
+{
+	__u64 key = (__u64)napi;
+	struct pool_stat *ps;
+	__u64 *pool;
+
+	pool = bpf_map_lookup_elem(&napis, &key);
+	if (!pool)
+		return 0;
+
+	ps = bpf_map_lookup_elem(&pools, pool);
+	if (!ps || bpf_ktime_get_ns() - ps->alloc_ns < alloc_refresh_ns)
+		return 0;
+
+	alloc_sample((const struct page_pool *)*pool, ps);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: MIT
+/*
+ * rastat: readahead effectiveness per file and device.
+ *
+ * Every folio inserted into the page cache while a task is inside
+ * page_cache_sync_ra(), page_cache_async_ra(), force_page_cache_ra() or
+ * page_cache_ra_order() is remembered together with its inode.  These
+ * nest (sync readahead may force, and all of them end up in
+ * page_cache_ra_order()), so only the outermost call is counted, and a
+ * page_cache_ra_order() that is outermost is mmap read-around from
+ * do_sync_mmap_readahead().  A folio's fate decides the verdict:
+ *
+ *	used	folio_mark_accessed() (read(2) and friends), or
+ *		set_pte_range() mapping it into a page table (mmap)
+ *	wasted	mm_filemap_delete_from_page_cache while still untouched
+ *
+ * Page table accessed bits are not visible here, so an mmap folio counts
+ * as used once it is mapped, including by fault-around; mmap waste is
+ * therefore under-reported rather than over-reported.
+ *
+ * On the way out of each outermost call the file's f_ra window (size,
+ * async_size, ra_pages) is sampled, so user space can compare the window
+ * the kernel chose with the fraction of it that was consumed.  Device
+ * totals are the sum over inodes sharing inode_key.dev.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "mm.h"
+#include "path.h"
+
+#define MAX_TASKS	16384
+#define MAX_FOLIOS	262144
+#define MAX_FILES	16384
+
+enum ra_kind {
+	RA_SYNC,
+	RA_ASYNC,
+	RA_FORCED,
+	RA_MMAP,
+	RA_MAX,
+};
+
+struct ra_ctx {
+	struct inode_key inode;
+	__u32 depth;
+	__u32 pad;
+};
+
+struct ra_folio {
+	struct inode_key inode;
+	__u64 added_ns;
+	__u64 nr_pages;
+};
+
+struct ra_stat {
+	__u64 calls[RA_MAX];
+	__u64 window_pages;
+	__u64 window_max;
+	__u64 async_pages;
+	__u32 ra_pages;
+	__u32 pad;
+	__u64 pages_added;
+	__u64 pages_used;
+	__u64 pages_wasted;
+	/* Time from insertion to first access, in microseconds. */
+	struct hist use_hist;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct ra_ctx);
+} in_ra SEC(".maps");
+
+/* Folios evicted from this table are simply not judged. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_FOLIOS);
+	__type(key, __u64);
+	__type(value, struct ra_folio);
+} folios SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FILES);
+	__type(key, struct inode_key);
+	__type(value, struct ra_stat);
+} stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_FILES);
+	__type(key, struct inode_key);
+	__type(value, struct file_path);
+} paths SEC(".maps");
+
+static struct ra_stat zero_stat;
+
+static __always_inline void ra_enter(struct readahead_control *ractl)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct ra_ctx c = { .depth = 1 }, *cp;
+	struct file *file;
+
+	cp = bpf_map_lookup_elem(&in_ra, &tid);
+	if (cp) {
+		cp->depth++;
+		return;
+	}
+
+	inode_key_of(&c.inode, BPF_CORE_READ(ractl, mapping, host));
+	bpf_map_update_elem(&in_ra, &tid, &c, BPF_ANY);
+
+	file = BPF_CORE_READ(ractl, file);
+	if (file)
+		path_note(&paths, file);
+}
+
+static __always_inline void ra_exit(struct readahead_control *ractl,
+				   enum ra_kind kind)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct file_ra_state *ra;
+	struct ra_stat *st;
+	struct ra_ctx *c;
+	__u32 size;
+
+	c = bpf_map_lookup_elem(&in_ra, &tid);
+	if (!c)
+		return;
+	if (--c->depth)
+		return;
+
+	st = map_lookup_or_try_init(&stats, &c->inode, &zero_stat);
+	bpf_map_delete_elem(&in_ra, &tid);
+	if (!st)
+		return;
+
+	ra = BPF_CORE_READ(ractl, ra);
+	size = BPF_CORE_READ(ra, size);
+	__sync_fetch_and_add(&st->calls[kind], 1);
+	__sync_fetch_and_add(&st->window_pages, size);
+	__sync_fetch_and_add(&st->async_pages, BPF_CORE_READ(ra, async_size));
+	max_store(&st->window_max, size);
+	st->ra_pages = BPF_CORE_READ(ra, ra_pages);
+}
+
+SEC("fentry/page_cache_sync_ra")
+int BPF_PROG(sync_ra_enter, struct readahead_control *ractl)
+{
+	ra_enter(ractl);
+	return 0;
+}
+
+SEC("fexit/page_cache_sync_ra")
+int BPF_PROG(sync_ra_exit, struct readahead_control *ractl)
+{
+	ra_exit(ractl, RA_SYNC);
+	return 0;
+}
+
+SEC("fentry/page_cache_async_ra")
+int BPF_PROG(async_ra_enter, struct readahead_control *ractl)
+{
+	ra_enter(ractl);
+	return 0;
+}
+
+SEC("fexit/page_cache_async_ra")
+int BPF_PROG(async_ra_exit, struct readahead_control *ractl)
+{
+	ra_exit(ractl, RA_ASYNC);
+	return 0;
+}
+
+SEC("fentry/force_page_cache_ra")
+int BPF_PROG(force_ra_enter, struct readahead_control *ractl)
+{
+	ra_enter(ractl);
+	return 0;
+}
+
+SEC("fexit/force_page_cache_ra")
+int BPF_PROG(force_ra_exit, struct readahead_control *ractl)
+{
+	ra_exit(ractl, RA_FORCED);
+	return 0;
+}
+
+SEC("fentry/page_cache_ra_order")
+int BPF_PROG(ra_order_enter, struct readahead_control *ractl)
+{
+	ra_enter(ractl);
+	return 0;
+}
+
+SEC("fexit/page_cache_ra_order")
+int BPF_PROG(ra_order_exit, struct readahead_control *ractl)
+{
+	ra_exit(ractl, RA_MMAP);
+	return 0;
+}
+
+SEC("tp_btf/mm_filemap_add_to_page_cache")
+int BPF_PROG(add_to_page_cache, struct folio *folio)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 key = (__u64)folio;
+	struct ra_folio f = {};
+	struct ra_stat *st;
+	struct ra_ctx *c;
+
+	c = bpf_map_lookup_elem(&in_ra, &tid);
+	if (!c)
+		return 0;
+
+	f.inode = c->inode;
+	f.nr_pages = folio_nr_pages(folio);
+	f.added_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&folios, &key, &f, BPF_ANY);
+
+	st = map_lookup_or_try_init(&stats, &c->inode, &zero_stat);
+	if (st)
+		__sync_fetch_and_add(&st->pages_added, f.nr_pages);
+	return 0;
+}
+
+static __always_inline void folio_used(struct folio *folio)
+{
+	__u64 key = (__u64)folio;
+	struct ra_folio *f;
+	struct ra_stat *st;
+
+	f = bpf_map_lookup_elem(&folios, &key);
+	if (!f)
+		return;
+
+	st = bpf_map_lookup_elem(&stats, &f->inode);
+	if (st) {
+		__sync_fetch_and_add(&st->pages_used, f->nr_pages);
+		hist_add(&st->use_hist,
+			 (bpf_ktime_get_ns() - f->added_ns) / NSEC_PER_USEC);
+	}
+	bpf_map_delete_elem(&folios, &key);
+}
+
+SEC("fentry/folio_mark_accessed")
+int BPF_PROG(mark_accessed, struct folio *folio)
+{
+	folio_used(folio);
+	return 0;
+}
+
+SEC("fentry/set_pte_range")
+int BPF_PROG(set_pte_range, struct vm_fault *vmf, struct folio *folio)
+{
+	folio_used(folio);
+	return 0;
+}
+
+SEC("tp_btf/mm_filemap_delete_from_page_cache")
+int BPF_PROG(delete_from_page_cache, struct folio *folio)
+{
+	__u64 key = (__u64)folio;
+	struct ra_folio *f;
+	struct ra_stat *st;
+
+	f = bpf_map_lookup_elem(&folios, &key);
+	if (!f)
+		return 0;
+
+	st = bpf_map_lookup_elem(&stats, &f->inode);
+	if (st)
+		__sync_fetch_and_add(&st->pages_wasted, f->nr_pages);
+	bpf_map_delete_elem(&folios, &key);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: MIT
+/*
+ * rcumon: RCU grace-period duration and per-CPU callback backlog.
+ *
+ * Grace periods are timed from the "start" to the "end" rcu_grace_period
+ * event.  Per CPU we track callbacks queued on the segmented callback list,
+ * callbacks invoked, the queue length reported by the tracepoints and
+ * how long each callback batch took.
+ *
+ * kvfree_rcu() objects mostly bypass that list: kvfree_call_rcu() batches
+ * them into per-CPU kfree_rcu_cpu pages that a workqueue frees after a
+ * grace period, with no qlen tracepoint on the way in.  They are counted
+ * globally in `kvfree`, queued at kvfree_call_rcu() entry and drained by
+ * rcu_invoke_kfree_bulk_callback (nr_records at a time) and
+ * rcu_invoke_kvfree_callback, so queued - freed is the pending backlog.
+ *
+ * Everything is plain counters that user space reads on its own schedule;
+ * only alerts go through the ring buffer:
+ *
+ *	ALERT_BACKLOG	a CPU's queue crossed qlen_alert, then every doubling
+ *	ALERT_SLOW_GP	a grace period took longer than gp_alert_ns
+ *	ALERT_STALL	rcu_stall_warning fired
+ *	ALERT_KVFREE	the kvfree_rcu backlog crossed qlen_alert, then every
+ *			doubling
+ *
+ * The rcu tracepoints need CONFIG_RCU_TRACE.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_CPUS	1024
+#define MSG_LEN		32
+
+const volatile __s64 qlen_alert = 10000;
+const volatile __u64 gp_alert_ns = 100 * NSEC_PER_MSEC;
+
+enum alert_kind {
+	ALERT_BACKLOG,
+	ALERT_SLOW_GP,
+	ALERT_STALL,
+	ALERT_KVFREE,
+};
+
+struct alert {
+	__u64 ts;
+	__u32 cpu;
+	__u32 kind;
+	__s64 value;
+	char msg[MSG_LEN];
+};
+
+struct gp_stat {
+	__u64 start_ns;
+	__s64 gp_seq;
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+	struct hist hist;
+};
+
+struct kvfree_stat {
+	__u64 queued;
+	__u64 freed;
+	__u64 bulk_batches;
+	__s64 backlog_max;
+	__s64 alerted_backlog;
+};
+
+struct cpu_rcu {
+	__u64 queued;
+	__u64 invoked;
+	__u64 batches;
+	__u64 batch_ns;
+	__u64 batch_max_ns;
+	__u64 batch_start_ns;
+	__s64 qlen;
+	__s64 qlen_max;
+	__s64 alerted_qlen;
+	struct hist qlen_hist;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct gp_stat);
+} gp SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct kvfree_stat);
+} kvfree SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CPUS);
+	__type(key, __u32);
+	__type(value, struct cpu_rcu);
+} cpus SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 64 * 1024);
+} alerts SEC(".maps");
+
+static __always_inline struct cpu_rcu *cpu_get(void)
+{
+	__u32 cpu = bpf_get_smp_processor_id();
+
+	return bpf_map_lookup_elem(&cpus, &cpu);
+}
+
+static __always_inline void alert(__u32 kind, __s64 value, const char *msg)
+{
+	struct alert *a;
+
+	a = bpf_ringbuf_reserve(&alerts, sizeof(*a), 0);
+	if (!a)
+		return;
+
+	a->ts = bpf_ktime_get_ns();
+	a->cpu = bpf_get_smp_processor_id();
+	a->kind = kind;
+	a->value = value;
+	a->msg[0] = '\0';
+	if (msg)
+		bpf_probe_read_kernel_str(a->msg, sizeof(a->msg), msg);
+	bpf_ringbuf_submit(a, 0);
+}
+
+static __always_inline void note_qlen(struct cpu_rcu *c, __s64 qlen)
+{
+	c->qlen = qlen;
+	if (qlen > c->qlen_max)
+		c->qlen_max = qlen;
+
+	if (qlen < qlen_alert || qlen < 2 * c->alerted_qlen)
+		return;
+
+	c->alerted_qlen = qlen;
+	alert(ALERT_BACKLOG, qlen, NULL);
+}
+
+SEC("tracepoint/rcu/rcu_grace_period")
+int handle_grace_period(struct trace_event_raw_rcu_grace_period *ctx)
+{
+	__u64 now = bpf_ktime_get_ns();
+	struct gp_stat *g;
+	char ev[8] = {};
+	__u32 zero = 0;
+	__u64 delta;
+
+	bpf_probe_read_kernel_str(ev, sizeof(ev), ctx->gpevent);
+
+	/* Only the "start" and "end" events bracket a grace period. */
+	if (ev[0] == 's' && ev[1] == 't' && ev[2] == 'a' && ev[3] == 'r' &&
+	    ev[4] == 't' && ev[5] == '\0') {
+		g = bpf_map_lookup_elem(&gp, &zero);
+		if (g) {
+			g->start_ns = now;
+			g->gp_seq = ctx->gp_seq;
+		}
+		return 0;
+	}
+	if (ev[0] != 'e' || ev[1] != 'n' || ev[2] != 'd' || ev[3] != '\0')
+		return 0;
+
+	g = bpf_map_lookup_elem(&gp, &zero);
+	if (!g || !g->start_ns)
+		return 0;
+
+	delta = now - g->start_ns;
+	g->start_ns = 0;
+	g->count++;
+	g->total_ns += delta;
+	max_store(&g->max_ns, delta);
+	hist_add(&g->hist, delta / NSEC_PER_USEC);
+
+	if (delta >= gp_alert_ns)
+		alert(ALERT_SLOW_GP, delta, ctx->rcuname);
+	return 0;
+}
+
+SEC("tracepoint/rcu/rcu_callback")
+int handle_callback(struct trace_event_raw_rcu_callback *ctx)
+{
+	struct cpu_rcu *c = cpu_get();
+
+	if (!c)
+		return 0;
+
+	c->queued++;
+	note_qlen(c, ctx->qlen);
+	return 0;
+}
+
+/* Only kernels without kfree_rcu batching queue kvfree_rcu() here. */
+SEC("tracepoint/rcu/rcu_kvfree_callback")
+int handle_kvfree_callback(struct trace_event_raw_rcu_kvfree_callback *ctx)
+{
+	struct cpu_rcu *c = cpu_get();
+
+	if (!c)
+		return 0;
+
+	c->queued++;
+	note_qlen(c, ctx->qlen);
+	return 0;
+}
+
+static __always_inline struct kvfree_stat *kvfree_get(void)
+{
+	__u32 zero = 0;
+
+	return bpf_map_lookup_elem(&kvfree, &zero);
+}
+
+SEC("fentry/kvfree_call_rcu")
+int BPF_PROG(kvfree_call_rcu)
+{
+	struct kvfree_stat *k = kvfree_get();
+	__s64 backlog;
+
+	if (!k)
+		return 0;
+
+	backlog = __sync_add_and_fetch(&k->queued, 1) - k->freed;
+	if (backlog > k->backlog_max)
+		k->backlog_max = backlog;
+
+	if (backlog < qlen_alert || backlog < 2 * k->alerted_backlog)
+		return 0;
+
+	k->alerted_backlog = backlog;
+	alert(ALERT_KVFREE, backlog, NULL);
+	return 0;
+}
+
+static __always_inline void kvfree_drain(__u64 nr)
+{
+	struct kvfree_stat *k = kvfree_get();
+
+	if (!k)
+		return;
+
+	__sync_fetch_and_add(&k->freed, nr);
+	/* Re-arm the backlog alert once the pile has drained. */
+	if ((__s64)(k->queued - k->freed) < qlen_alert / 2)
+		k->alerted_backlog = 0;
+}
+
+SEC("tracepoint/rcu/rcu_invoke_kfree_bulk_callback")
+int handle_invoke_kfree_bulk(struct trace_event_raw_rcu_invoke_kfree_bulk_callback *ctx)
+{
+	struct kvfree_stat *k = kvfree_get();
+
+	if (k)
+		__sync_fetch_and_add(&k->bulk_batches, 1);
+	kvfree_drain(ctx->nr_records);
+	return 0;
+}
+
+SEC("tracepoint/rcu/rcu_invoke_kvfree_callback")
+int handle_invoke_kvfree(struct trace_event_raw_rcu_invoke_kvfree_callback *ctx)
+{
+	kvfree_drain(1);
+	return 0;
+}
+
+SEC("tracepoint/rcu/rcu_batch_start")
+int handle_batch_start(struct trace_event_raw_rcu_batch_start *ctx)
+{
+	struct cpu_rcu *c = cpu_get();
+
+	if (!c)
+		return 0;
+
+	c->batch_start_ns = bpf_ktime_get_ns();
+	hist_add(&c->qlen_hist, ctx->qlen);
+	note_qlen(c, ctx->qlen);
+
+	/* Re-arm the backlog alert once the queue has drained. */
+	if (ctx->qlen < qlen_alert / 2)
+		c->alerted_qlen = 0;
+	return 0;
+}
+
+SEC("tracepoint/rcu/rcu_batch_end")
+int handle_batch_end(struct trace_event_raw_rcu_batch_end *ctx)
+{
+	struct cpu_rcu *c = cpu_get();
+	__u64 delta;
+
+	if (!c || !c->batch_start_ns)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - c->batch_start_ns;
+	c->batch_start_ns = 0;
+	c->batches++;
+	c->invoked += ctx->callbacks_invoked;
+	c->batch_ns += delta;
+	max_store(&c->batch_max_ns, delta);
+	return 0;
+}
+
+SEC("tracepoint/rcu/rcu_stall_warning")
+int handle_stall_warning(struct trace_event_raw_rcu_stall_warning *ctx)
+{
+	alert(ALERT_STALL, 0, ctx->msg);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: MIT
+/*
+ * reclaimstall: memory-pressure stalls per cgroup and allocation site.
+ *
+ * Stalls are charged to the cgroup of the task that suffered them:
+ *
+ *	STALL_DIRECT	mm_vmscan_direct_reclaim_begin -> _end
+ *	STALL_MEMCG	mm_vmscan_memcg_reclaim_begin -> _end (memory.high/max)
+ *	STALL_THROTTLE	mm_vmscan_throttled, usec_delayed as reported
+ *	STALL_KSWAPD	mm_vmscan_wakeup_kswapd, counted but not timed
+ *
+ * `cgroups` holds count/time/histogram per (cgroup, kind, sub), where sub
+ * is the allocation order for reclaim and the throttle reason for
+ * STALL_THROTTLE.  `sites` aggregates the same stalls per kernel stack
+ * captured at the allocation that entered reclaim, which is where the
+ * "who caused it" answer lives that PSI cannot give; stacks resolve
+ * through the ksym iterator with ksym_all set.  kswapd's own busy time per
+ * node comes from kswapd_wake -> kswapd_sleep.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_TASKS	16384
+#define MAX_STACKS	16384
+#define MAX_STAT	16384
+#define MAX_NODES	64
+#define PERF_MAX_STACK_DEPTH	127
+
+enum stall_kind {
+	STALL_DIRECT,
+	STALL_MEMCG,
+	STALL_THROTTLE,
+	STALL_KSWAPD,
+};
+
+const volatile __u32 stack_skip = 2;
+const volatile __u64 targ_cgid = 0;
+
+struct reclaim_start {
+	__u64 ts;
+	__s32 stack_id;
+	__u32 kind;
+	__u32 order;
+	__u32 pad;
+};
+
+struct stall_key {
+	__u64 cgid;
+	__u32 kind;
+	__u32 sub;
+};
+
+struct stall_stat {
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+	__u64 nr_reclaimed;
+	struct hist hist;
+};
+
+struct site_key {
+	__u64 cgid;
+	__s32 stack_id;
+	__u32 kind;
+};
+
+struct site_stat {
+	__u64 count;
+	__u64 total_ns;
+	char comm[TASK_COMM_LEN];
+};
+
+struct kswapd_stat {
+	__u64 wake_ns;
+	__u64 runs;
+	__u64 busy_ns;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, struct reclaim_start);
+} start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(max_entries, MAX_STACKS);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct stall_key);
+	__type(value, struct stall_stat);
+} cgroups SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct site_key);
+	__type(value, struct site_stat);
+} sites SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_NODES);
+	__type(key, __u32);
+	__type(value, struct kswapd_stat);
+} kswapd SEC(".maps");
+
+static struct stall_stat zero_stall;
+static struct site_stat zero_site;
+
+static __always_inline void account(__u32 kind, __u32 sub, __s32 stack_id,
+				    __u64 delta, __u64 nr_reclaimed)
+{
+	struct stall_key key = {
+		.cgid = bpf_get_current_cgroup_id(),
+		.kind = kind,
+		.sub = sub,
+	};
+	struct site_key skey = {
+		.cgid = key.cgid,
+		.stack_id = stack_id,
+		.kind = kind,
+	};
+	struct stall_stat *st;
+	struct site_stat *ss;
+
+	if (targ_cgid && key.cgid != targ_cgid)
+		return;
+
+	st = map_lookup_or_try_init(&cgroups, &key, &zero_stall);
+	if (st) {
+		__sync_fetch_and_add(&st->count, 1);
+		__sync_fetch_and_add(&st->total_ns, delta);
+		__sync_fetch_and_add(&st->nr_reclaimed, nr_reclaimed);
+		max_store(&st->max_ns, delta);
+		hist_add(&st->hist, delta / NSEC_PER_USEC);
+	}
+
+	if (stack_id < 0)
+		return;
+
+	ss = bpf_map_lookup_elem(&sites, &skey);
+	if (!ss) {
+		ss = map_lookup_or_try_init(&sites, &skey, &zero_site);
+		if (!ss)
+			return;
+		bpf_get_current_comm(ss->comm, sizeof(ss->comm));
+	}
+	__sync_fetch_and_add(&ss->count, 1);
+	__sync_fetch_and_add(&ss->total_ns, delta);
+}
+
+static __always_inline void reclaim_begin(void *ctx, __u32 kind, int order)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct reclaim_start s = {
+		.kind = kind,
+		.order = order,
+	};
+
+	s.stack_id = bpf_get_stackid(ctx, &stacks,
+				     stack_skip & BPF_F_SKIP_FIELD_MASK);
+	s.ts = bpf_ktime_get_ns();
+	/* A memcg reclaim inside direct reclaim belongs to the outer one. */
+	bpf_map_update_elem(&start, &tid, &s, BPF_NOEXIST);
+}
+
+static __always_inline void reclaim_end(__u32 kind, __u64 nr_reclaimed)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct reclaim_start *s;
+	__u64 delta;
+
+	s = bpf_map_lookup_elem(&start, &tid);
+	if (!s || s->kind != kind)
+		return;
+
+	delta = bpf_ktime_get_ns() - s->ts;
+	account(kind, s->order, s->stack_id, delta, nr_reclaimed);
+	bpf_map_delete_elem(&start, &tid);
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_direct_reclaim_begin")
+int handle_direct_begin(struct trace_event_raw_mm_vmscan_direct_reclaim_begin_template *ctx)
+{
+	reclaim_begin(ctx, STALL_DIRECT, ctx->order);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_direct_reclaim_end")
+int handle_direct_end(struct trace_event_raw_mm_vmscan_direct_reclaim_end_template *ctx)
+{
+	reclaim_end(STALL_DIRECT, ctx->nr_reclaimed);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_memcg_reclaim_begin")
+int handle_memcg_begin(struct trace_event_raw_mm_vmscan_direct_reclaim_begin_template *ctx)
+{
+	reclaim_begin(ctx, STALL_MEMCG, ctx->order);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_memcg_reclaim_end")
+int handle_memcg_end(struct trace_event_raw_mm_vmscan_direct_reclaim_end_template *ctx)
+{
+	reclaim_end(STALL_MEMCG, ctx->nr_reclaimed);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_throttled")
+int handle_throttled(struct trace_event_raw_mm_vmscan_throttled *ctx)
+{
+	__s32 stack_id;
+
+	stack_id = bpf_get_stackid(ctx, &stacks,
+				   stack_skip & BPF_F_SKIP_FIELD_MASK);
+	account(STALL_THROTTLE, ctx->reason, stack_id,
+		(__u64)ctx->usec_delayed * NSEC_PER_USEC, 0);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_wakeup_kswapd")
+int handle_wakeup_kswapd(struct trace_event_raw_mm_vmscan_wakeup_kswapd *ctx)
+{
+	__s32 stack_id;
+
+	stack_id = bpf_get_stackid(ctx, &stacks,
+				   stack_skip & BPF_F_SKIP_FIELD_MASK);
+	account(STALL_KSWAPD, ctx->order, stack_id, 0, 0);
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_kswapd_wake")
+int handle_kswapd_wake(struct trace_event_raw_mm_vmscan_kswapd_wake *ctx)
+{
+	__u32 nid = ctx->nid;
+	struct kswapd_stat *k;
+
+	k = bpf_map_lookup_elem(&kswapd, &nid);
+	if (k && !k->wake_ns)
+		k->wake_ns = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("tracepoint/vmscan/mm_vmscan_kswapd_sleep")
+int handle_kswapd_sleep(struct trace_event_raw_mm_vmscan_kswapd_sleep *ctx)
+{
+	__u32 nid = ctx->nid;
+	struct kswapd_stat *k;
+
+	k = bpf_map_lookup_elem(&kswapd, &nid);
+	if (!k || !k->wake_ns)
+		return 0;
+
+	k->runs++;
+	k->busy_ns += bpf_ktime_get_ns() - k->wake_ns;
+	k->wake_ns = 0;
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
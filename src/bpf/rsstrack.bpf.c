@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: MIT
+/*
+ * rsstrack: per-process RSS over time, with growth alerts.
+ *
+ * The rss_stat tracepoint fires whenever an mm counter moves; all it does
+ * here is mark the mm in `dirty`.  User space attaches the map element
+ * iterator to `dirty` and reads the link once per interval, so the program
+ * only runs for the mms marked since the last pass and the BPF work and
+ * the output scale with the processes that changed, not with all of them.
+ * Each mm is sampled through its owner task (CONFIG_MEMCG) as one struct
+ * rss_sample written raw with bpf_seq_write():
+ *
+ *	anon/file/shmem/swap	mm rss_stat, in pages
+ *	total_vm/peak		mm->total_vm and the largest RSS seen
+ *
+ * An mm's mark is cleared and its state updated only once the sample is in
+ * the buffer, since the iterator shows the same element again after a
+ * seq_file overflow.  __mmdrop() clears the mark of an mm that goes away
+ * before it is sampled.
+ *
+ * `procs` keeps the latest sample of every process for top-N reporting.
+ * Growth is judged per window: once a process has been tracked for
+ * window_ns, RSS above the window's starting value by growth_pages raises
+ * an alert on `alerts` and the next window starts from the current value,
+ * which catches slow leaks that a rate threshold would miss.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "mm.h"
+
+#define MAX_PROCS	65536
+#define MAX_DIRTY	65536
+
+const volatile __u64 window_ns = 600 * NSEC_PER_SEC;
+/* 256 MiB with 4 KiB pages. */
+const volatile __u64 growth_pages = 65536;
+
+struct rss_sample {
+	__u32 tgid;
+	__u32 pad;
+	__u64 ts_ns;
+	__u64 anon;
+	__u64 file;
+	__u64 shmem;
+	__u64 swap;
+	__u64 total_vm;
+	__u64 peak;
+	__u64 cgid;
+	char comm[TASK_COMM_LEN];
+};
+
+struct proc_state {
+	struct rss_sample last;
+	__u64 window_start_ns;
+	__u64 window_start_rss;
+};
+
+struct rss_alert {
+	__u32 tgid;
+	__u32 pad;
+	__u64 cgid;
+	__u64 from_pages;
+	__u64 to_pages;
+	__u64 window_ns;
+	char comm[TASK_COMM_LEN];
+};
+
+/* An evicted mm is simply sampled on the next change. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_DIRTY);
+	__type(key, __u64);
+	__type(value, __u8);
+} dirty SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROCS);
+	__type(key, __u32);
+	__type(value, struct proc_state);
+} procs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} alerts SEC(".maps");
+
+static struct proc_state zero_state;
+
+SEC("tp_btf/rss_stat")
+int BPF_PROG(rss_stat, struct mm_struct *mm, int member)
+{
+	__u64 key = (__u64)mm;
+	__u8 one = 1;
+
+	if (!bpf_map_lookup_elem(&dirty, &key))
+		bpf_map_update_elem(&dirty, &key, &one, BPF_ANY);
+	return 0;
+}
+
+SEC("fentry/__mmdrop")
+int BPF_PROG(mmdrop, struct mm_struct *mm)
+{
+	__u64 key = (__u64)mm;
+
+	bpf_map_delete_elem(&dirty, &key);
+	return 0;
+}
+
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(sched_process_exit, struct task_struct *p)
+{
+	__u32 tgid = p->tgid;
+
+	if (p->pid == p->tgid)
+		bpf_map_delete_elem(&procs, &tgid);
+	return 0;
+}
+
+static __always_inline void growth_check(struct proc_state *ps, __u64 rss)
+{
+	struct rss_sample *s = &ps->last;
+	struct rss_alert *a;
+
+	if (s->ts_ns - ps->window_start_ns < window_ns)
+		return;
+
+	if (rss >= ps->window_start_rss + growth_pages) {
+		a = bpf_ringbuf_reserve(&alerts, sizeof(*a), 0);
+		if (a) {
+			a->tgid = s->tgid;
+			a->cgid = s->cgid;
+			a->from_pages = ps->window_start_rss;
+			a->to_pages = rss;
+			a->window_ns = s->ts_ns - ps->window_start_ns;
+			__builtin_memcpy(a->comm, s->comm, sizeof(a->comm));
+			bpf_ringbuf_submit(a, 0);
+		}
+	}
+	ps->window_start_ns = s->ts_ns;
+	ps->window_start_rss = rss;
+}
+
+SEC("iter/bpf_map_elem")
+int dump_rss(struct bpf_iter__bpf_map_elem *ctx)
+{
+	struct seq_file *seq = ctx->meta->seq;
+	struct rss_sample s = {};
+	struct task_struct *owner;
+	struct proc_state *ps;
+	struct mm_struct *mm;
+	__u64 key, rss;
+
+	if (!ctx->key)
+		return 0;
+
+	key = *(__u64 *)ctx->key;
+	mm = (struct mm_struct *)key;
+	owner = BPF_CORE_READ(mm, owner);
+	if (!owner) {
+		bpf_map_delete_elem(&dirty, &key);
+		return 0;
+	}
+
+	s.tgid = BPF_CORE_READ(owner, tgid);
+	ps = bpf_map_lookup_elem(&procs, &s.tgid);
+	if (!ps) {
+		ps = map_lookup_or_try_init(&procs, &s.tgid, &zero_state);
+		if (!ps)
+			return 0;
+		BPF_CORE_READ_STR_INTO(&ps->last.comm, owner, comm);
+	}
+
+	s.ts_ns = bpf_ktime_get_ns();
+	s.anon = mm_counter(mm, MM_ANONPAGES);
+	s.file = mm_counter(mm, MM_FILEPAGES);
+	s.shmem = mm_counter(mm, MM_SHMEMPAGES);
+	s.swap = mm_counter(mm, MM_SWAPENTS);
+	s.total_vm = BPF_CORE_READ(mm, total_vm);
+	s.cgid = BPF_CORE_READ(owner, cgroups, dfl_cgrp, kn, id);
+	__builtin_memcpy(s.comm, ps->last.comm, sizeof(s.comm));
+
+	rss = s.anon + s.file + s.shmem;
+	s.peak = rss > ps->last.peak ? rss : ps->last.peak;
+
+	if (bpf_seq_write(seq, &s, sizeof(s)))
+		return 0;
+
+	ps->last = s;
+	if (!ps->window_start_ns) {
+		ps->window_start_ns = s.ts_ns;
+		ps->window_start_rss = rss;
+	}
+	growth_check(ps, rss);
+	bpf_map_delete_elem(&dirty, &key);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
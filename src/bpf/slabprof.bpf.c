@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: MIT
+/*
+ * slabprof: slab allocations and frees by cache and call stack.
+ *
+ * tp_btf kmem_cache_alloc/kmem_cache_free carry the struct kmem_cache, so
+ * every event is counted per cache in a per-CPU map, which keeps the hot
+ * path free of shared cache lines.  Plain kmalloc() only reports its size
+ * class, so those allocations are counted under the class size itself
+ * (bytes_alloc, named "kmalloc-<size>"), which never collides with a
+ * kernel address.  Objects whose address hashes into one bucket of
+ * `sample_every` also take a kernel stack and are remembered in `live`
+ * until they are freed:
+ *
+ *	caches	allocs/frees/bytes of every event, per cache; kmalloc
+ *		classes only see allocs, kfree() does not say the class
+ *	sites	sampled allocs/frees/bytes per (cache, stack), plus the
+ *		sampled objects and bytes still outstanding
+ *	totals	sampled allocs, and lru_misses: sampled frees that found
+ *		nothing in `live`
+ *
+ * Frees are matched from kmem_cache_free, kfree (which also ends most
+ * kfree_rcu() objects) and kmem_cache_free_bulk(), which kfree_rcu()
+ * batches and the networking skb caches use.  Sampling by address rather
+ * than at random is what lets a free know it should have been tracked, so
+ * lru_misses counts objects evicted from `live` (and, right after attach,
+ * objects allocated before it); a rising rate means the outstanding counts
+ * are biased low and MAX_LIVE or sample_every needs raising.
+ *
+ * Outstanding objects per site are what points at slab growth; user space
+ * scales site numbers by sample_every.  Stack depth is the `stacks` value
+ * size, which user space may shrink with bpf_map__set_value_size() before
+ * load to cut the cost of each sample.  Stacks resolve through the ksym
+ * iterator with ksym_all set.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_CACHES	1024
+#define MAX_SITES	16384
+#define MAX_STACKS	16384
+#define MAX_LIVE	262144
+#define CACHE_NAME_LEN	32
+#define PERF_MAX_STACK_DEPTH	127
+#define MAX_BULK	512
+
+const volatile __u32 sample_every = 64;
+const volatile __u32 stack_skip = 1;
+
+struct cache_stat {
+	__u64 allocs;
+	__u64 frees;
+	__u64 bytes;
+};
+
+struct cache_info {
+	__u32 object_size;
+	__u32 size;
+	char name[CACHE_NAME_LEN];
+};
+
+struct site_key {
+	__u64 cache;
+	__s32 stack_id;
+	__u32 pad;
+};
+
+/* Per-CPU slots: frees land on any CPU, so live counts only add up summed. */
+struct site_stat {
+	__u64 allocs;
+	__u64 frees;
+	__u64 bytes;
+	__s64 live;
+	__s64 live_bytes;
+};
+
+struct live_obj {
+	struct site_key site;
+	__u64 bytes;
+};
+
+struct slab_totals {
+	__u64 sampled;
+	__u64 lru_misses;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, MAX_CACHES);
+	__type(key, __u64);
+	__type(value, struct cache_stat);
+} caches SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_CACHES);
+	__type(key, __u64);
+	__type(value, struct cache_info);
+} names SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_STACK_TRACE);
+	__uint(max_entries, MAX_STACKS);
+	__uint(key_size, sizeof(__u32));
+	__uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(__u64));
+} stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, MAX_SITES);
+	__type(key, struct site_key);
+	__type(value, struct site_stat);
+} sites SEC(".maps");
+
+/* Objects evicted from this table show up as lru_misses when freed. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_LIVE);
+	__type(key, __u64);
+	__type(value, struct live_obj);
+} live SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct slab_totals);
+} totals SEC(".maps");
+
+static struct cache_stat zero_cache;
+static struct cache_info zero_info;
+static struct site_stat zero_site;
+
+static __always_inline void cache_note(struct kmem_cache *s, __u64 key)
+{
+	struct cache_info *ci;
+
+	if (bpf_map_lookup_elem(&names, &key))
+		return;
+
+	ci = map_lookup_or_try_init(&names, &key, &zero_info);
+	if (!ci)
+		return;
+
+	ci->object_size = BPF_CORE_READ(s, object_size);
+	ci->size = BPF_CORE_READ(s, size);
+	bpf_probe_read_kernel_str(ci->name, sizeof(ci->name),
+				  BPF_CORE_READ(s, name));
+}
+
+static __always_inline void kmalloc_note(__u64 key)
+{
+	struct cache_info *ci;
+
+	if (bpf_map_lookup_elem(&names, &key))
+		return;
+
+	ci = map_lookup_or_try_init(&names, &key, &zero_info);
+	if (!ci)
+		return;
+
+	ci->object_size = key;
+	ci->size = key;
+	BPF_SNPRINTF(ci->name, sizeof(ci->name), "kmalloc-%llu", key);
+}
+
+static __always_inline struct slab_totals *totals_get(void)
+{
+	__u32 zero = 0;
+
+	return bpf_map_lookup_elem(&totals, &zero);
+}
+
+/* Multiplicative hash, so slab alignment does not pick the bucket. */
+static __always_inline bool sampled(const void *ptr)
+{
+	__u64 h = ((__u64)ptr >> 3) * 0x9E3779B97F4A7C15ULL;
+
+	return sample_every <= 1 || (h >> 32) % sample_every == 0;
+}
+
+static __always_inline void obj_alloc(void *ctx, __u64 cache, const void *ptr,
+				      __u64 bytes)
+{
+	struct live_obj obj = {};
+	struct slab_totals *t;
+	struct site_stat *ss;
+	__u64 key;
+
+	if (!sampled(ptr))
+		return;
+
+	obj.site.cache = cache;
+	obj.site.stack_id = bpf_get_stackid(ctx, &stacks,
+					    stack_skip & BPF_F_SKIP_FIELD_MASK);
+	obj.bytes = bytes;
+
+	ss = map_lookup_or_try_init(&sites, &obj.site, &zero_site);
+	if (!ss)
+		return;
+
+	ss->allocs++;
+	ss->bytes += bytes;
+	ss->live++;
+	ss->live_bytes += bytes;
+
+	t = totals_get();
+	if (t)
+		t->sampled++;
+
+	key = (__u64)ptr;
+	bpf_map_update_elem(&live, &key, &obj, BPF_ANY);
+}
+
+static __always_inline void obj_free(const void *ptr)
+{
+	__u64 key = (__u64)ptr;
+	struct slab_totals *t;
+	struct site_stat *ss;
+	struct live_obj *obj;
+
+	if (!ptr || !sampled(ptr))
+		return;
+
+	obj = bpf_map_lookup_elem(&live, &key);
+	if (!obj) {
+		t = totals_get();
+		if (t)
+			t->lru_misses++;
+		return;
+	}
+
+	ss = map_lookup_or_try_init(&sites, &obj->site, &zero_site);
+	if (ss) {
+		ss->frees++;
+		ss->live--;
+		ss->live_bytes -= obj->bytes;
+	}
+	bpf_map_delete_elem(&live, &key);
+}
+
+/*
+ * Plain increments are enough on per-CPU values: a program does not nest
+ * on its own CPU, an irq allocation that interrupts it is skipped instead.
+ */
+SEC("tp_btf/kmem_cache_alloc")
+int BPF_PROG(cache_alloc, unsigned long call_site, const void *ptr,
+	     struct kmem_cache *s, gfp_t gfp_flags, int node)
+{
+	__u64 cache = (__u64)s;
+	struct cache_stat *cs;
+	__u32 bytes;
+
+	if (!ptr || !s)
+		return 0;
+
+	cs = map_lookup_or_try_init(&caches, &cache, &zero_cache);
+	if (!cs)
+		return 0;
+
+	if (!cs->allocs)
+		cache_note(s, cache);
+	bytes = BPF_CORE_READ(s, size);
+	cs->allocs++;
+	cs->bytes += bytes;
+
+	obj_alloc(ctx, cache, ptr, bytes);
+	return 0;
+}
+
+SEC("tp_btf/kmalloc")
+int BPF_PROG(kmalloc, unsigned long call_site, const void *ptr,
+	     size_t bytes_req, size_t bytes_alloc, gfp_t gfp_flags, int node)
+{
+	__u64 cache = bytes_alloc;
+	struct cache_stat *cs;
+
+	if (!ptr)
+		return 0;
+
+	cs = map_lookup_or_try_init(&caches, &cache, &zero_cache);
+	if (!cs)
+		return 0;
+
+	if (!cs->allocs)
+		kmalloc_note(cache);
+	cs->allocs++;
+	cs->bytes += bytes_alloc;
+
+	obj_alloc(ctx, cache, ptr, bytes_alloc);
+	return 0;
+}
+
+SEC("tp_btf/kmem_cache_free")
+int BPF_PROG(cache_free, unsigned long call_site, const void *ptr,
+	     struct kmem_cache *s)
+{
+	__u64 cache = (__u64)s;
+	struct cache_stat *cs;
+
+	cs = bpf_map_lookup_elem(&caches, &cache);
+	if (cs)
+		cs->frees++;
+
+	obj_free(ptr);
+	return 0;
+}
+
+SEC("tp_btf/kfree")
+int BPF_PROG(kfree, unsigned long call_site, const void *ptr)
+{
+	obj_free(ptr);
+	return 0;
+}
+
+/* Bulk frees fire no per-object tracepoint; @s is NULL for kfree_bulk(). */
+SEC("fentry/kmem_cache_free_bulk")
+int BPF_PROG(cache_free_bulk, struct kmem_cache *s, size_t size, void **p)
+{
+	__u64 cache = (__u64)s;
+	struct cache_stat *cs;
+	void *ptr;
+	__u32 i;
+
+	cs = bpf_map_lookup_elem(&caches, &cache);
+	if (cs)
+		cs->frees += size;
+
+	for (i = 0; i < MAX_BULK && i < size; i++) {
+		if (bpf_probe_read_kernel(&ptr, sizeof(ptr), &p[i]))
+			break;
+		obj_free(ptr);
+	}
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,44 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+#
+# Load/verify smoke test: every object in $1 (default .output) is loaded
+# with all its programs and maps, which runs the verifier and resolves
+# CO-RE relocations and attach targets against the running kernel, then
+# unpinned again without attaching anything.  Exits 77 (skipped) when it
+# cannot run here, 1 if any object fails to load.
+
+set -u
+
+dir=${1:-.output}
+bpftool=${BPFTOOL:-bpftool}
+pin=/sys/fs/bpf/cx-smoke.$$
+
+if [ "$(id -u)" != 0 ]; then
+	echo "smoke: needs root, skipping"
+	exit 77
+fi
+if [ ! -r /sys/kernel/btf/vmlinux ]; then
+	echo "smoke: kernel has no BTF, skipping"
+	exit 77
+fi
+if ! command -v "$bpftool" >/dev/null 2>&1; then
+	echo "smoke: $bpftool not found, skipping"
+	exit 77
+fi
+
+fail=0
+for obj in "$dir"/*.bpf.o; do
+	[ -e "$obj" ] || { echo "smoke: no objects in $dir"; exit 1; }
+	name=$(basename "$obj" .bpf.o)
+	if out=$("$bpftool" prog loadall "$obj" "$pin/$name" 2>&1); then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		echo "$out" | tail -n 20 | sed 's/^/	/'
+		fail=1
+	fi
+	rm -rf "$pin/$name"
+done
+rmdir "$pin" 2>/dev/null
+
+exit $fail
@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: MIT
+/*
+ * thpcollapse: khugepaged scan and collapse outcome per process.
+ *
+ * khugepaged runs as a kthread, so the process is recovered from the mm
+ * the tracepoints carry (mm->owner, CONFIG_MEMCG).  Per process we count
+ *
+ *	scans		mm_khugepaged_scan_pmd / mm_khugepaged_scan_file
+ *	collapses	mm_collapse_huge_page / mm_khugepaged_collapse_file
+ *	results[]	every scan and collapse outcome by enum scan_result
+ *
+ * and the time spent in hpage_collapse_scan_{pmd,file}(), which includes
+ * the collapse itself: a process with lots of scan time and few
+ * SCAN_SUCCEED results is burning khugepaged CPU for nothing.  The same
+ * paths serve MADV_COLLAPSE, which is accounted the same way.  The
+ * owner's cgroup id is kept with each process so user space can roll the
+ * numbers up to whatever level THP policy is set at.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_PROCS	16384
+#define MAX_TASKS	1024
+#define MAX_RESULTS	48
+
+enum thp_op {
+	THP_SCAN_ANON,
+	THP_SCAN_FILE,
+	THP_COLLAPSE_ANON,
+	THP_COLLAPSE_FILE,
+	THP_OP_MAX,
+};
+
+struct proc_key {
+	/* mm is only set when the owner could not be resolved. */
+	__u64 mm;
+	__u32 tgid;
+	__u32 pad;
+};
+
+struct thp_stat {
+	__u64 ops[THP_OP_MAX];
+	__u64 ok[THP_OP_MAX];
+	__u64 shmem;
+	__u64 scan_ns;
+	__u64 results[MAX_RESULTS];
+	__u64 cgid;
+	char comm[TASK_COMM_LEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_PROCS);
+	__type(key, struct proc_key);
+	__type(value, struct thp_stat);
+} procs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} scan_start SEC(".maps");
+
+static struct thp_stat zero_stat;
+
+static __always_inline struct thp_stat *proc_get(struct mm_struct *mm)
+{
+	struct task_struct *owner = NULL;
+	struct proc_key key = {};
+	struct thp_stat *st;
+
+	if (bpf_core_field_exists(mm->owner))
+		owner = BPF_CORE_READ(mm, owner);
+	if (owner)
+		key.tgid = BPF_CORE_READ(owner, tgid);
+	else
+		key.mm = (__u64)mm;
+
+	st = bpf_map_lookup_elem(&procs, &key);
+	if (st)
+		return st;
+
+	st = map_lookup_or_try_init(&procs, &key, &zero_stat);
+	if (!st || !owner)
+		return st;
+
+	st->cgid = BPF_CORE_READ(owner, cgroups, dfl_cgrp, kn, id);
+	BPF_CORE_READ_STR_INTO(&st->comm, owner, comm);
+	return st;
+}
+
+static __always_inline void account(struct mm_struct *mm, enum thp_op op,
+				    int result)
+{
+	struct thp_stat *st = proc_get(mm);
+
+	if (!st)
+		return;
+
+	__sync_fetch_and_add(&st->ops[op], 1);
+	if (result == SCAN_SUCCEED)
+		__sync_fetch_and_add(&st->ok[op], 1);
+	if (result >= 0 && result < MAX_RESULTS)
+		__sync_fetch_and_add(&st->results[result], 1);
+}
+
+SEC("tracepoint/huge_memory/mm_khugepaged_scan_pmd")
+int handle_scan_pmd(struct trace_event_raw_mm_khugepaged_scan_pmd *ctx)
+{
+	account(ctx->mm, THP_SCAN_ANON, ctx->status);
+	return 0;
+}
+
+SEC("tracepoint/huge_memory/mm_khugepaged_scan_file")
+int handle_scan_file(struct trace_event_raw_mm_khugepaged_scan_file *ctx)
+{
+	account(ctx->mm, THP_SCAN_FILE, ctx->result);
+	return 0;
+}
+
+SEC("tracepoint/huge_memory/mm_collapse_huge_page")
+int handle_collapse(struct trace_event_raw_mm_collapse_huge_page *ctx)
+{
+	account(ctx->mm, THP_COLLAPSE_ANON, ctx->status);
+	return 0;
+}
+
+SEC("tracepoint/huge_memory/mm_khugepaged_collapse_file")
+int handle_collapse_file(struct trace_event_raw_mm_khugepaged_collapse_file *ctx)
+{
+	struct thp_stat *st;
+
+	account(ctx->mm, THP_COLLAPSE_FILE, ctx->result);
+	if (!ctx->is_shmem)
+		return 0;
+
+	st = proc_get(ctx->mm);
+	if (st)
+		__sync_fetch_and_add(&st->shmem, 1);
+	return 0;
+}
+
+static __always_inline void scan_enter(void)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 now = bpf_ktime_get_ns();
+
+	bpf_map_update_elem(&scan_start, &tid, &now, BPF_ANY);
+}
+
+static __always_inline void scan_exit(struct mm_struct *mm)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct thp_stat *st;
+	__u64 *tsp, delta;
+
+	tsp = bpf_map_lookup_elem(&scan_start, &tid);
+	if (!tsp)
+		return;
+
+	delta = bpf_ktime_get_ns() - *tsp;
+	bpf_map_delete_elem(&scan_start, &tid);
+
+	st = proc_get(mm);
+	if (st)
+		__sync_fetch_and_add(&st->scan_ns, delta);
+}
+
+SEC("fentry/hpage_collapse_scan_pmd")
+int BPF_PROG(scan_pmd_enter, struct mm_struct *mm)
+{
+	scan_enter();
+	return 0;
+}
+
+SEC("fexit/hpage_collapse_scan_pmd")
+int BPF_PROG(scan_pmd_exit, struct mm_struct *mm)
+{
+	scan_exit(mm);
+	return 0;
+}
+
+SEC("fentry/hpage_collapse_scan_file")
+int BPF_PROG(scan_file_enter, struct mm_struct *mm)
+{
+	scan_enter();
+	return 0;
+}
+
+SEC("fexit/hpage_collapse_scan_file")
+int BPF_PROG(scan_file_exit, struct mm_struct *mm)
+{
+	scan_exit(mm);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: MIT
+/*
+ * timerlag: timer expiry lateness per callback and per CPU.
+ *
+ * Timer wheel timers are measured in jiffies:
+ *
+ *	slack	bucket_expiry - expires	(granularity imposed by the wheel)
+ *	late	now - bucket_expiry	(at timer_expire_entry)
+ *
+ * so wheel slack is not counted again as lateness.
+ *
+ * hrtimers are measured in nanoseconds of their own clock base:
+ *
+ *	slack	expires - softexpires	(hrtimer_set_expires_range slack)
+ *	late	now - expires		(at hrtimer_expire_entry)
+ *
+ * Results are aggregated per (callback, CPU, kind) in `stats`; callback
+ * addresses are resolved through the ksym iterator (see ksym.h).
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_TIMERS	65536
+#define MAX_STATS	16384
+
+enum timer_kind {
+	TIMER_WHEEL	= 0,
+	TIMER_HR	= 1,
+};
+
+/* A sample counts as "late" once it reaches these thresholds. */
+const volatile __u64 late_jiffies = 1;
+const volatile __u64 late_ns = 50 * NSEC_PER_USEC;
+
+/* `deadline` is the wheel bucket's expiry or the hrtimer's hard expiry. */
+struct armed {
+	__s64 deadline;
+	__s64 slack;
+};
+
+struct timer_key {
+	__u64 function;
+	__u32 cpu;
+	__u32 kind;
+};
+
+/* Units are jiffies for TIMER_WHEEL and nanoseconds for TIMER_HR. */
+struct timer_stat {
+	__u64 count;
+	__u64 late_count;
+	__u64 late_total;
+	__u64 late_max;
+	__u64 slack_total;
+	struct hist late_hist;
+};
+
+/* Deleted timers never expire; LRU keeps the table from filling up. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_TIMERS);
+	__type(key, __u64);
+	__type(value, struct armed);
+} armed SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STATS);
+	__type(key, struct timer_key);
+	__type(value, struct timer_stat);
+} stats SEC(".maps");
+
+static struct timer_stat zero_stat;
+
+static __always_inline void account(__u64 function, __u32 kind, __s64 late,
+				    __s64 slack, __u64 thresh)
+{
+	struct timer_key key = {
+		.function = function,
+		.cpu = bpf_get_smp_processor_id(),
+		.kind = kind,
+	};
+	struct timer_stat *st;
+
+	st = bpf_map_lookup_elem(&stats, &key);
+	if (!st) {
+		ksym_note(function);
+		st = map_lookup_or_try_init(&stats, &key, &zero_stat);
+		if (!st)
+			return;
+	}
+
+	/* An hrtimer with a slack range may run before its hard expiry. */
+	if (late < 0)
+		late = 0;
+	if (slack < 0)
+		slack = 0;
+
+	__sync_fetch_and_add(&st->count, 1);
+	__sync_fetch_and_add(&st->slack_total, slack);
+	hist_add(&st->late_hist, late);
+	if ((__u64)late < thresh)
+		return;
+
+	__sync_fetch_and_add(&st->late_count, 1);
+	__sync_fetch_and_add(&st->late_total, late);
+	max_store(&st->late_max, late);
+}
+
+SEC("tracepoint/timer/timer_start")
+int handle_timer_start(struct trace_event_raw_timer_start *ctx)
+{
+	__u64 timer = (__u64)ctx->timer;
+	struct armed a = {
+		.deadline = ctx->bucket_expiry,
+		.slack = ctx->bucket_expiry - ctx->expires,
+	};
+
+	bpf_map_update_elem(&armed, &timer, &a, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/timer/timer_expire_entry")
+int handle_timer_expire(struct trace_event_raw_timer_expire_entry *ctx)
+{
+	__u64 timer = (__u64)ctx->timer;
+	struct armed *a;
+	__s64 late, slack;
+
+	a = bpf_map_lookup_elem(&armed, &timer);
+	if (!a)
+		return 0;
+
+	late = (__s64)ctx->now - a->deadline;
+	slack = a->slack;
+	bpf_map_delete_elem(&armed, &timer);
+
+	account((__u64)ctx->function, TIMER_WHEEL, late, slack, late_jiffies);
+	return 0;
+}
+
+SEC("tracepoint/timer/hrtimer_start")
+int handle_hrtimer_start(struct trace_event_raw_hrtimer_start *ctx)
+{
+	__u64 timer = (__u64)ctx->hrtimer;
+	struct armed a = {
+		.deadline = ctx->expires,
+		.slack = ctx->expires - ctx->softexpires,
+	};
+
+	bpf_map_update_elem(&armed, &timer, &a, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/timer/hrtimer_expire_entry")
+int handle_hrtimer_expire(struct trace_event_raw_hrtimer_expire_entry *ctx)
+{
+	__u64 timer = (__u64)ctx->hrtimer;
+	struct armed *a;
+	__s64 late, slack;
+
+	a = bpf_map_lookup_elem(&armed, &timer);
+	if (!a)
+		return 0;
+
+	late = ctx->now - a->deadline;
+	slack = a->slack;
+	bpf_map_delete_elem(&armed, &timer);
+
+	account((__u64)ctx->function, TIMER_HR, late, slack, late_ns);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: MIT
+/*
+ * uringlat: io_uring request latency per ring and sqe opcode.
+ *
+ * Each request is followed from io_uring_submit_req to the
+ * io_uring_complete that carries no IORING_CQE_F_MORE, and its latency
+ * lands in `ops` keyed by (ring, opcode, path):
+ *
+ *	PATH_INLINE	completed without leaving the submitter
+ *	PATH_POLL	io_uring_poll_arm, waited for readiness first
+ *	PATH_ASYNC	io_uring_queue_async_work, punted to an io-wq worker
+ *
+ * For punted requests the time before the punt (the failed inline try)
+ * and the time after it (queueing plus the worker) are kept apart.  Per
+ * ring, `rings` counts submissions, SQPOLL submissions,
+ * io_uring_cqring_wait calls with their min_events, and CQE overflows,
+ * which mean the application is not reaping fast enough.
+ *
+ * Rings are keyed by their io_ring_ctx address, which the allocator hands
+ * out again once a ring is gone.  io_ring_ctx_free() therefore drops the
+ * ring's entries from `rings` and `ops`, so a new ring never inherits a
+ * dead one's counters or comm; whatever was not scraped by then is lost.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_REQS	65536
+#define MAX_OPS		16384
+#define MAX_RINGS	4096
+#define CQE_F_MORE	(1U << 1)
+
+enum uring_path {
+	PATH_INLINE,
+	PATH_POLL,
+	PATH_ASYNC,
+};
+
+const volatile __u32 targ_tgid = 0;
+
+struct req_start {
+	__u64 ts;
+	__u64 punt_ts;
+	__u64 ring;
+	__u8 opcode;
+	__u8 path;
+	__u16 pad[3];
+};
+
+struct op_key {
+	__u64 ring;
+	__u8 opcode;
+	__u8 path;
+	__u16 pad[3];
+};
+
+struct op_stat {
+	__u64 count;
+	__u64 errors;
+	__u64 total_ns;
+	__u64 max_ns;
+	__u64 pre_punt_ns;
+	__u64 worker_ns;
+	/* Submit to final completion, in microseconds. */
+	struct hist hist;
+};
+
+struct ring_stat {
+	__u32 tgid;
+	__u32 pad;
+	__u64 submitted;
+	__u64 sq_thread;
+	__u64 punted;
+	__u64 waits;
+	__u64 wait_min_events;
+	__u64 overflows;
+	char comm[TASK_COMM_LEN];
+};
+
+/* Requests lost from this table are simply not timed. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_REQS);
+	__type(key, __u64);
+	__type(value, struct req_start);
+} reqs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_OPS);
+	__type(key, struct op_key);
+	__type(value, struct op_stat);
+} ops SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_RINGS);
+	__type(key, __u64);
+	__type(value, struct ring_stat);
+} rings SEC(".maps");
+
+static struct op_stat zero_op;
+static struct ring_stat zero_ring;
+
+/* The first task to touch a ring names it. */
+static __always_inline struct ring_stat *ring_get(void *ctx)
+{
+	__u64 key = (__u64)ctx;
+	struct ring_stat *rs;
+
+	rs = bpf_map_lookup_elem(&rings, &key);
+	if (rs)
+		return rs;
+
+	rs = map_lookup_or_try_init(&rings, &key, &zero_ring);
+	if (rs) {
+		rs->tgid = bpf_get_current_pid_tgid() >> 32;
+		bpf_get_current_comm(rs->comm, sizeof(rs->comm));
+	}
+	return rs;
+}
+
+static long op_drop(struct bpf_map *map, struct op_key *key,
+		    struct op_stat *val, __u64 *ring)
+{
+	if (key->ring == *ring)
+		bpf_map_delete_elem(map, key);
+	return 0;
+}
+
+SEC("fentry/io_ring_ctx_free")
+int BPF_PROG(io_ring_ctx_free, struct io_ring_ctx *ring)
+{
+	__u64 key = (__u64)ring;
+
+	if (bpf_map_delete_elem(&rings, &key))
+		return 0;
+	bpf_for_each_map_elem(&ops, op_drop, &key, 0);
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_submit_req")
+int handle_submit_req(struct trace_event_raw_io_uring_submit_req *ctx)
+{
+	struct req_start s = {};
+	struct ring_stat *rs;
+	__u64 key = (__u64)ctx->req;
+
+	if (targ_tgid && (bpf_get_current_pid_tgid() >> 32) != targ_tgid)
+		return 0;
+
+	s.ts = bpf_ktime_get_ns();
+	s.ring = (__u64)ctx->ctx;
+	s.opcode = ctx->opcode;
+	bpf_map_update_elem(&reqs, &key, &s, BPF_ANY);
+
+	rs = ring_get(ctx->ctx);
+	if (!rs)
+		return 0;
+	__sync_fetch_and_add(&rs->submitted, 1);
+	if (ctx->sq_thread)
+		__sync_fetch_and_add(&rs->sq_thread, 1);
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_poll_arm")
+int handle_poll_arm(struct trace_event_raw_io_uring_poll_arm *ctx)
+{
+	__u64 key = (__u64)ctx->req;
+	struct req_start *s;
+
+	s = bpf_map_lookup_elem(&reqs, &key);
+	if (s && s->path == PATH_INLINE)
+		s->path = PATH_POLL;
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_queue_async_work")
+int handle_queue_async_work(struct trace_event_raw_io_uring_queue_async_work *ctx)
+{
+	__u64 key = (__u64)ctx->req;
+	struct ring_stat *rs;
+	struct req_start *s;
+
+	s = bpf_map_lookup_elem(&reqs, &key);
+	if (!s)
+		return 0;
+
+	s->path = PATH_ASYNC;
+	s->punt_ts = bpf_ktime_get_ns();
+
+	rs = bpf_map_lookup_elem(&rings, &s->ring);
+	if (rs)
+		__sync_fetch_and_add(&rs->punted, 1);
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_complete")
+int handle_complete(struct trace_event_raw_io_uring_complete *ctx)
+{
+	__u64 key = (__u64)ctx->req;
+	struct op_key okey = {};
+	struct req_start *s;
+	struct op_stat *st;
+	__u64 now, delta;
+
+	/* Multishot requests post several CQEs; only the last one ends it. */
+	if (!key || (ctx->cflags & CQE_F_MORE))
+		return 0;
+
+	s = bpf_map_lookup_elem(&reqs, &key);
+	if (!s)
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	delta = now - s->ts;
+	okey.ring = s->ring;
+	okey.opcode = s->opcode;
+	okey.path = s->path;
+
+	st = map_lookup_or_try_init(&ops, &okey, &zero_op);
+	if (st) {
+		__sync_fetch_and_add(&st->count, 1);
+		__sync_fetch_and_add(&st->total_ns, delta);
+		max_store(&st->max_ns, delta);
+		if (ctx->res < 0)
+			__sync_fetch_and_add(&st->errors, 1);
+		if (s->punt_ts) {
+			__sync_fetch_and_add(&st->pre_punt_ns, s->punt_ts - s->ts);
+			__sync_fetch_and_add(&st->worker_ns, now - s->punt_ts);
+		}
+		hist_add(&st->hist, delta / NSEC_PER_USEC);
+	}
+
+	bpf_map_delete_elem(&reqs, &key);
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_cqring_wait")
+int handle_cqring_wait(struct trace_event_raw_io_uring_cqring_wait *ctx)
+{
+	__u64 key = (__u64)ctx->ctx;
+	struct ring_stat *rs = bpf_map_lookup_elem(&rings, &key);
+
+	if (!rs)
+		return 0;
+
+	__sync_fetch_and_add(&rs->waits, 1);
+	__sync_fetch_and_add(&rs->wait_min_events, ctx->min_events);
+	return 0;
+}
+
+SEC("tracepoint/io_uring/io_uring_cqe_overflow")
+int handle_cqe_overflow(struct trace_event_raw_io_uring_cqe_overflow *ctx)
+{
+	__u64 key = (__u64)ctx->ctx;
+	struct ring_stat *rs = bpf_map_lookup_elem(&rings, &key);
+
+	if (rs)
+		__sync_fetch_and_add(&rs->overflows, 1);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: MIT
+/*
+ * wbstall: writeback backlog and dirty throttling per (bdi, cgroup).
+ *
+ * Everything is keyed by the bdi name the writeback tracepoints carry
+ * ("8:0", "253:1", ...) and a cgroup id.  Dirtying and throttling happen
+ * in the writer's context and use its cgroup; the flusher side uses the
+ * cgroup_ino of the bdi_writeback, which on cgroup v2 is the id of the
+ * memcg that owns the dirty pages.
+ *
+ *	inodes_dirtied		writeback_dirty_inode
+ *	inodes_written/pages	writeback_single_inode_start -> _single_inode
+ *	works/work_ns/reasons	writeback_start -> writeback_written
+ *	throttles/pause		balance_dirty_pages, pause converted from
+ *				jiffies; wb_dirty/wb_setpoint are the backlog
+ *				and its target at the last throttle
+ *
+ * global_dirty_state and writeback_pages_written feed one global entry, so
+ * a stall can be compared against the system-wide dirty limit.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+
+#define MAX_TASKS	16384
+#define MAX_STAT	16384
+#define BDI_NAME_LEN	32
+#define MAX_WB_REASON	16
+
+extern unsigned int CONFIG_HZ __kconfig;
+
+struct wb_key {
+	char bdi[BDI_NAME_LEN];
+	__u64 cgid;
+};
+
+struct wb_stat {
+	__u64 inodes_dirtied;
+	__u64 inodes_written;
+	__u64 pages_written;
+	__u64 write_ns;
+	__u64 works;
+	__u64 work_ns;
+	__u64 work_reason[MAX_WB_REASON];
+	__u64 throttles;
+	__u64 pause_ns;
+	__u64 max_pause_ns;
+	__u64 wb_dirty;
+	__u64 wb_setpoint;
+	/* Throttle pauses, in microseconds. */
+	struct hist pause_hist;
+};
+
+struct wb_global {
+	__u64 nr_dirty;
+	__u64 nr_writeback;
+	__u64 background_thresh;
+	__u64 dirty_thresh;
+	__u64 dirty_limit;
+	__u64 pages_written;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} inode_start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_TASKS);
+	__type(key, __u32);
+	__type(value, __u64);
+} work_start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_STAT);
+	__type(key, struct wb_key);
+	__type(value, struct wb_stat);
+} stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct wb_global);
+} global SEC(".maps");
+
+static struct wb_stat zero_stat;
+
+static __always_inline struct wb_stat *stat_get(const char *bdi, __u64 cgid)
+{
+	struct wb_key key = { .cgid = cgid };
+
+	__builtin_memcpy(key.bdi, bdi, sizeof(key.bdi));
+	return map_lookup_or_try_init(&stats, &key, &zero_stat);
+}
+
+static __always_inline void start_note(void *map)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 now = bpf_ktime_get_ns();
+
+	bpf_map_update_elem(map, &tid, &now, BPF_ANY);
+}
+
+static __always_inline __u64 start_take(void *map)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 *tsp, delta;
+
+	tsp = bpf_map_lookup_elem(map, &tid);
+	if (!tsp)
+		return 0;
+	delta = bpf_ktime_get_ns() - *tsp;
+	bpf_map_delete_elem(map, &tid);
+	return delta;
+}
+
+SEC("tracepoint/writeback/writeback_dirty_inode")
+int handle_dirty_inode(struct trace_event_raw_writeback_dirty_inode_template *ctx)
+{
+	struct wb_stat *st = stat_get(ctx->name, bpf_get_current_cgroup_id());
+
+	if (st)
+		__sync_fetch_and_add(&st->inodes_dirtied, 1);
+	return 0;
+}
+
+SEC("tracepoint/writeback/writeback_single_inode_start")
+int handle_single_inode_start(struct trace_event_raw_writeback_single_inode_template *ctx)
+{
+	start_note(&inode_start);
+	return 0;
+}
+
+SEC("tracepoint/writeback/writeback_single_inode")
+int handle_single_inode(struct trace_event_raw_writeback_single_inode_template *ctx)
+{
+	__u64 delta = start_take(&inode_start);
+	struct wb_stat *st = stat_get(ctx->name, ctx->cgroup_ino);
+
+	if (!st)
+		return 0;
+
+	__sync_fetch_and_add(&st->inodes_written, 1);
+	__sync_fetch_and_add(&st->pages_written, ctx->wrote);
+	__sync_fetch_and_add(&st->write_ns, delta);
+	return 0;
+}
+
+SEC("tracepoint/writeback/writeback_start")
+int handle_work_start(struct trace_event_raw_writeback_work_class *ctx)
+{
+	start_note(&work_start);
+	return 0;
+}
+
+SEC("tracepoint/writeback/writeback_written")
+int handle_work_written(struct trace_event_raw_writeback_work_class *ctx)
+{
+	__u64 delta = start_take(&work_start);
+	struct wb_stat *st = stat_get(ctx->name, ctx->cgroup_ino);
+	__u32 reason = ctx->reason;
+
+	if (!st)
+		return 0;
+
+	__sync_fetch_and_add(&st->works, 1);
+	__sync_fetch_and_add(&st->work_ns, delta);
+	if (reason < MAX_WB_REASON)
+		__sync_fetch_and_add(&st->work_reason[reason], 1);
+	return 0;
+}
+
+SEC("tracepoint/writeback/balance_dirty_pages")
+int handle_balance_dirty_pages(struct trace_event_raw_balance_dirty_pages *ctx)
+{
+	struct wb_stat *st = stat_get(ctx->bdi, bpf_get_current_cgroup_id());
+	__u64 pause_ns = 0;
+
+	if (!st)
+		return 0;
+
+	/* A zero or negative pause only adjusted the ratelimit. */
+	if (ctx->pause > 0 && CONFIG_HZ)
+		pause_ns = (__u64)ctx->pause * NSEC_PER_SEC / CONFIG_HZ;
+
+	__sync_fetch_and_add(&st->throttles, 1);
+	__sync_fetch_and_add(&st->pause_ns, pause_ns);
+	max_store(&st->max_pause_ns, pause_ns);
+	hist_add(&st->pause_hist, pause_ns / NSEC_PER_USEC);
+	st->wb_dirty = ctx->bdi_dirty;
+	st->wb_setpoint = ctx->bdi_setpoint;
+	return 0;
+}
+
+SEC("tracepoint/writeback/global_dirty_state")
+int handle_global_dirty_state(struct trace_event_raw_global_dirty_state *ctx)
+{
+	__u32 zero = 0;
+	struct wb_global *g = bpf_map_lookup_elem(&global, &zero);
+
+	if (!g)
+		return 0;
+
+	g->nr_dirty = ctx->nr_dirty;
+	g->nr_writeback = ctx->nr_writeback;
+	g->background_thresh = ctx->background_thresh;
+	g->dirty_thresh = ctx->dirty_thresh;
+	g->dirty_limit = ctx->dirty_limit;
+	return 0;
+}
+
+SEC("tracepoint/writeback/writeback_pages_written")
+int handle_pages_written(struct trace_event_raw_writeback_pages_written *ctx)
+{
+	__u32 zero = 0;
+	struct wb_global *g = bpf_map_lookup_elem(&global, &zero);
+
+	if (g)
+		__sync_fetch_and_add(&g->pages_written, ctx->pages);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: MIT
+/*
+ * wqlat: workqueue latency per work function.
+ *
+ * For every work item we measure
+ *
+ *	queue   -> activate	time parked on the inactive list (max_active)
+ *	activate -> execute	time waiting for a kworker to pick it up
+ *	execute start -> end	time spent running the work function
+ *
+ * and aggregate all three per work function in the `stats` map.  Function
+ * addresses are resolved through the ksym iterator (see ksym.h).
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common.h"
+#include "ksym.h"
+
+#define MAX_WORKS	65536
+#define MAX_FUNCS	4096
+
+/* Drop pending or execution samples shorter than this (ns). */
+const volatile __u64 min_lat_ns = 0;
+
+struct pending {
+	__u64 queued_ns;
+	__u64 activated_ns;
+};
+
+struct running {
+	__u64 function;
+	__u64 start_ns;
+};
+
+struct wq_stat {
+	__u64 count;
+	__u64 inactive_ns;
+	__u64 pending_ns;
+	__u64 exec_ns;
+	__u64 pending_max_ns;
+	__u64 exec_max_ns;
+	struct hist pending_hist;
+	struct hist exec_hist;
+};
+
+/*
+ * Work that is cancelled before it runs never reaches execute_start, so
+ * the per-work tables are LRU to bound the leak.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_WORKS);
+	__type(key, __u64);
+	__type(value, struct pending);
+} pending SEC(".maps");
+
+/* Keyed by kworker tid: a worker runs one item at a time. */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, MAX_WORKS);
+	__type(key, __u32);
+	__type(value, struct running);
+} running SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FUNCS);
+	__type(key, __u64);
+	__type(value, struct wq_stat);
+} stats SEC(".maps");
+
+static struct wq_stat zero_stat;
+
+static __always_inline struct wq_stat *stat_get(__u64 function)
+{
+	struct wq_stat *st;
+
+	st = bpf_map_lookup_elem(&stats, &function);
+	if (st)
+		return st;
+
+	ksym_note(function);
+	return map_lookup_or_try_init(&stats, &function, &zero_stat);
+}
+
+SEC("tracepoint/workqueue/workqueue_queue_work")
+int handle_queue_work(struct trace_event_raw_workqueue_queue_work *ctx)
+{
+	struct pending p = {};
+	__u64 work = (__u64)ctx->work;
+
+	p.queued_ns = bpf_ktime_get_ns();
+	bpf_map_update_elem(&pending, &work, &p, BPF_ANY);
+	return 0;
+}
+
+SEC("tracepoint/workqueue/workqueue_activate_work")
+int handle_activate_work(struct trace_event_raw_workqueue_activate_work *ctx)
+{
+	__u64 work = (__u64)ctx->work;
+	struct pending *p;
+
+	p = bpf_map_lookup_elem(&pending, &work);
+	if (p)
+		p->activated_ns = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("tracepoint/workqueue/workqueue_execute_start")
+int handle_execute_start(struct trace_event_raw_workqueue_execute_start *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	__u64 work = (__u64)ctx->work;
+	__u64 now = bpf_ktime_get_ns();
+	struct running r = {};
+	struct wq_stat *st;
+	struct pending *p;
+	__u64 inactive, wait;
+
+	r.function = (__u64)ctx->function;
+	r.start_ns = now;
+	bpf_map_update_elem(&running, &tid, &r, BPF_ANY);
+
+	p = bpf_map_lookup_elem(&pending, &work);
+	if (!p)
+		return 0;
+
+	/* activate_work fires synchronously unless max_active throttled. */
+	if (!p->activated_ns)
+		p->activated_ns = p->queued_ns;
+	inactive = p->activated_ns - p->queued_ns;
+	wait = now - p->activated_ns;
+	bpf_map_delete_elem(&pending, &work);
+
+	if (inactive + wait < min_lat_ns)
+		return 0;
+
+	st = stat_get(r.function);
+	if (!st)
+		return 0;
+
+	__sync_fetch_and_add(&st->inactive_ns, inactive);
+	__sync_fetch_and_add(&st->pending_ns, inactive + wait);
+	max_store(&st->pending_max_ns, inactive + wait);
+	hist_add(&st->pending_hist, (inactive + wait) / NSEC_PER_USEC);
+	return 0;
+}
+
+SEC("tracepoint/workqueue/workqueue_execute_end")
+int handle_execute_end(struct trace_event_raw_workqueue_execute_end *ctx)
+{
+	__u32 tid = (__u32)bpf_get_current_pid_tgid();
+	struct wq_stat *st;
+	struct running *r;
+	__u64 delta;
+
+	r = bpf_map_lookup_elem(&running, &tid);
+	if (!r)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - r->start_ns;
+	st = delta >= min_lat_ns ? stat_get(r->function) : NULL;
+	bpf_map_delete_elem(&running, &tid);
+	if (!st)
+		return 0;
+
+	__sync_fetch_and_add(&st->count, 1);
+	__sync_fetch_and_add(&st->exec_ns, delta);
+	max_store(&st->exec_max_ns, delta);
+	hist_add(&st->exec_hist, delta / NSEC_PER_USEC);
+	return 0;
+}
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";